@@ -0,0 +1,193 @@
+//
+// Microbenchmark for the per-geometry file_read routines.
+//
+// Build from the repository root:
+//   gcc -O2 -I. bench/file_read_bench.c file_reader.c -pthread -o file_read_bench
+// Run:
+//   ./file_read_bench [scratch_image_path]
+//
+// For every specialised geometry (512-byte sectors, 4..64 sectors per cluster) it generates a FAT16 image
+// holding one file whose cluster chain is shuffled across the data area, then times whole-file reads
+// through the routine fat_open selected, through the generic routine, and through legacyReadClusters,
+// a copy of the file_read loop before geometry precomputation (runtime division, cluster re-read on
+// every call, byte-by-byte copy), all on the same open volume.
+//
+
+#define _XOPEN_SOURCE 700
+
+#include "file_reader.h"
+#include <time.h>
+
+#define BENCH_TOTAL_SECTORS 60000
+#define BENCH_RESERVED_SECTORS 1
+#define BENCH_NUM_FATS 2
+#define BENCH_ROOT_ENTRIES 512
+#define BENCH_FILE_SIZE (16u * 1024 * 1024)
+#define BENCH_REPEATS 10
+
+static uint32_t benchRandom(uint32_t *state) {
+	*state ^= *state << 13;
+	*state ^= *state >> 17;
+	*state ^= *state << 5;
+	return *state;
+}
+
+static int writeBenchImage(const char *path, unsigned sectorsPerCluster) {
+	size_t clusterSize = (size_t) SECTOR_SIZE * sectorsPerCluster;
+	uint16_t fatSize = (uint16_t) (((BENCH_TOTAL_SECTORS / sectorsPerCluster + FIRST_CLUSTER_OFFSET) * sizeof(uint16_t) + SECTOR_SIZE - 1) / SECTOR_SIZE);
+	uint32_t rootSector = BENCH_RESERVED_SECTORS + fatSize * BENCH_NUM_FATS;
+	uint32_t dataStart = rootSector + BENCH_ROOT_ENTRIES * sizeof(struct SFN_t) / SECTOR_SIZE;
+	uint32_t dataClusters = (BENCH_TOTAL_SECTORS - dataStart) / sectorsPerCluster;
+	uint32_t fileClusters = (uint32_t) ((BENCH_FILE_SIZE + clusterSize - 1) / clusterSize);
+
+	char *image = calloc(BENCH_TOTAL_SECTORS, SECTOR_SIZE);
+	uint16_t *clusters = malloc(dataClusters * sizeof(uint16_t));
+	if (image == NULL || clusters == NULL) {
+		free(image);
+		free(clusters);
+		return -1;
+	}
+
+	struct fatBootSector *boot = (struct fatBootSector *) image;
+	memcpy(boot->OEMName, "FATBENCH", 8);
+	boot->BytesPerSector = SECTOR_SIZE;
+	boot->SectorPerCluster = (unsigned char) sectorsPerCluster;
+	boot->SizeReservedArea = BENCH_RESERVED_SECTORS;
+	boot->NumFATs = BENCH_NUM_FATS;
+	boot->MaxNumOfFiles = BENCH_ROOT_ENTRIES;
+	boot->NumOfSectors1 = BENCH_TOTAL_SECTORS;
+	boot->MediaType = 0xF8;
+	boot->FatSize = fatSize;
+	memcpy(boot->FileSystemTypeLevel, "FAT16   ", 8);
+	boot->SignatureValue = SIGNATURE_VALUE;
+
+	uint32_t seed = 0x9E3779B9u;
+	for (uint32_t i = 0; i < dataClusters; i++) {
+		clusters[i] = (uint16_t) (i + FIRST_CLUSTER_OFFSET);
+	}
+	for (uint32_t i = dataClusters - 1; i > 0; i--) {
+		uint32_t j = benchRandom(&seed) % (i + 1);
+		uint16_t tmp = clusters[i];
+		clusters[i] = clusters[j];
+		clusters[j] = tmp;
+	}
+
+	uint16_t *fat = (uint16_t *) (image + BENCH_RESERVED_SECTORS * SECTOR_SIZE);
+	fat[0] = 0xFFF8;
+	fat[1] = 0xFFFF;
+	for (uint32_t i = 0; i < fileClusters; i++) {
+		fat[clusters[i]] = i + 1 < fileClusters ? clusters[i + 1] : 0xFFFF;
+		memset(image + (size_t) (dataStart + (clusters[i] - FIRST_CLUSTER_OFFSET) * sectorsPerCluster) * SECTOR_SIZE, (int) (i & 0xFF), clusterSize);
+	}
+	memcpy(image + (BENCH_RESERVED_SECTORS + fatSize) * SECTOR_SIZE, fat, (size_t) fatSize * SECTOR_SIZE);
+
+	struct SFN_t *entry = (struct SFN_t *) (image + rootSector * SECTOR_SIZE);
+	memcpy(entry->filename, "BENCH   BIN", FILE_NAME_LENGTH);
+	entry->fileAttribute = 1 << IS_ARCHIVED;
+	entry->firstClusterNumberLowBits = clusters[0];
+	entry->fileSize = BENCH_FILE_SIZE;
+
+	FILE *file = fopen(path, "wb");
+	int result = file != NULL && fwrite(image, SECTOR_SIZE, BENCH_TOTAL_SECTORS, file) == BENCH_TOTAL_SECTORS ? 0 : -1;
+	if (file != NULL) {
+		fclose(file);
+	}
+	free(image);
+	free(clusters);
+	return result;
+}
+
+static size_t legacyReadClusters(char *buffer, size_t expectedBytes, struct file_t *stream) {
+	size_t bytesRead = 0;
+	size_t clusterSize = stream->volume->bootSector.BytesPerSector * stream->volume->bootSector.SectorPerCluster;
+	size_t sectorSize = stream->volume->bootSector.BytesPerSector;
+	size_t sectorsToRead = clusterSize / sectorSize;
+	int clusterStartPosition = (int) (stream->volume->bootSector.SizeReservedArea + stream->volume->bootSector.FatSize * stream->volume->bootSector.NumFATs +
+	                                  (sizeof(struct SFN_t) * stream->volume->bootSector.MaxNumOfFiles) / sectorSize);
+
+	while (stream->offset < stream->file_info.fileSize && bytesRead < expectedBytes) {
+		int clusterNumber = (int) (stream->offset / clusterSize);
+		int sectorToRead = (int) (clusterStartPosition + (stream->chain->clusters[clusterNumber] - FIRST_CLUSTER_OFFSET) * sectorsToRead);
+		if (disk_read(stream->volume->disk, sectorToRead, stream->chain->clusterBuffer, (int) sectorsToRead) == -1) {
+			errno = ERANGE;
+			return (size_t) -1;
+		}
+		stream->chain->bufferedCluster = SIZE_MAX;
+		stream->chain->clusterOffset = stream->offset % clusterSize;
+		while ((stream->chain->clusterOffset < clusterSize) && (bytesRead < expectedBytes) && (stream->offset < stream->file_info.fileSize)) {
+			buffer[bytesRead] = stream->chain->clusterBuffer[stream->chain->clusterOffset];
+			stream->chain->clusterOffset++;
+			stream->offset++;
+			bytesRead++;
+		}
+	}
+	return bytesRead;
+}
+
+static double timeReads(struct volume_t *volume, char *buffer, size_t chunk) {
+	struct timespec start;
+	struct timespec end;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (int i = 0; i < BENCH_REPEATS; i++) {
+		struct file_t *file = file_open(volume, "BENCH.BIN");
+		if (file == NULL) {
+			return -1;
+		}
+		while (file_read(buffer, 1, chunk, file) > 0) {
+		}
+		file_close(file);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	return (double) (end.tv_sec - start.tv_sec) * 1e3 + (double) (end.tv_nsec - start.tv_nsec) / 1e6;
+}
+
+int main(int argc, char **argv) {
+	const char *path = argc > 1 ? argv[1] : "file_read_bench.img";
+	const unsigned geometries[] = {4, 8, 16, 32, 64};
+	const size_t chunks[] = {512, 64 * 1024};
+	char *buffer = malloc(64 * 1024);
+	if (buffer == NULL) {
+		return 1;
+	}
+
+	printf("%d whole-file reads of a %u-byte fragmented file\n", BENCH_REPEATS, BENCH_FILE_SIZE);
+	printf("%-9s %-7s %15s %11s %10s %17s %15s\n", "sec/clus", "chunk", "specialised ms", "generic ms", "legacy ms",
+	       "generic/special", "legacy/special");
+	for (size_t g = 0; g < sizeof(geometries) / sizeof(geometries[0]); g++) {
+		if (writeBenchImage(path, geometries[g]) == -1) {
+			perror("writeBenchImage");
+			free(buffer);
+			return 1;
+		}
+		struct disk_t *disk = disk_open_from_file(path);
+		struct volume_t *volume = disk == NULL ? NULL : fat_open(disk, 0);
+		if (volume == NULL) {
+			perror("fat_open");
+			disk_close(disk);
+			free(buffer);
+			return 1;
+		}
+		read_clusters_fn specialised = volume->readClusters;
+		// selectReadClusters has no specialisation for 1 sector per cluster, so this yields the generic routine,
+		// which takes shift and sector count from the open volume's own geometry at run time.
+		struct fat_geometry_t unspecialised = volume->geometry;
+		unspecialised.sectorsPerCluster = 1;
+		read_clusters_fn generic = selectReadClusters(&unspecialised);
+		timeReads(volume, buffer, chunks[1]);
+		for (size_t c = 0; c < sizeof(chunks) / sizeof(chunks[0]); c++) {
+			volume->readClusters = specialised;
+			double fast = timeReads(volume, buffer, chunks[c]);
+			volume->readClusters = generic;
+			double generic = timeReads(volume, buffer, chunks[c]);
+			volume->readClusters = legacyReadClusters;
+			double legacy = timeReads(volume, buffer, chunks[c]);
+			printf("%-9u %-7zu %15.1f %11.1f %10.1f %16.2fx %14.2fx\n", geometries[g], chunks[c], fast, generic, legacy,
+			       generic / fast, legacy / fast);
+		}
+		fat_close(volume);
+		disk_close(disk);
+	}
+	remove(path);
+	free(buffer);
+	return 0;
+}
@@ -2,9 +2,26 @@
 // Created by Krystian on 25.11.23.
 //
 
+#define _XOPEN_SOURCE 700
+
+#include <strings.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/stat.h>
 #include "file_reader.h"
+// Course test harness headers; they are not part of this repository, so the library also builds without them.
+#ifdef __has_include
+#if __has_include("tested_declarations.h")
+#include "tested_declarations.h"
+#endif
+#if __has_include("rdebug.h")
+#include "rdebug.h"
+#endif
+#else
 #include "tested_declarations.h"
 #include "rdebug.h"
+#endif
 
 ////////////////////////////////////////////////////////////////////////DISK
 
@@ -59,6 +76,23 @@ int disk_close(struct disk_t *pdisk) {
 	free(pdisk);
 	return 0;
 }
+// Positioned read that leaves the FILE position untouched, so several threads may share one disk.
+int disk_pread(struct disk_t *pdisk, int32_t first_sector, void *buffer, int32_t sectors_to_read) {
+	if (pdisk == NULL || buffer == NULL || sectors_to_read < 0) {
+		errno = EFAULT;
+		return -1;
+	}
+	if (first_sector < 0 || (uint32_t) (first_sector + sectors_to_read) > pdisk->numberOfSectors) {
+		errno = ERANGE;
+		return -1;
+	}
+	ssize_t expected = (ssize_t) sectors_to_read * SECTOR_SIZE;
+	if (pread(fileno(pdisk->pFile), buffer, expected, (off_t) first_sector * SECTOR_SIZE) != expected) {
+		errno = EIO;
+		return -1;
+	}
+	return 0;
+}
 ///////////////////////////////////////////////////////////////////////////VOLUME
 
 struct volume_t *fat_open(struct disk_t *pdisk, uint32_t first_sector) {
@@ -87,8 +121,23 @@ struct volume_t *fat_open(struct disk_t *pdisk, uint32_t first_sector) {
 		return NULL;
 	}
 
+	// disk_read works in SECTOR_SIZE units, so other sector sizes would be read short.
+	if (volume->bootSector.BytesPerSector != SECTOR_SIZE || !isPowerOfTwo(volume->bootSector.SectorPerCluster)) {
+		free(volume);
+		errno = EINVAL;
+		return NULL;
+	}
+
 	volume->disk = pdisk;
 
+	volume->geometry.sectorsPerCluster = volume->bootSector.SectorPerCluster;
+	volume->geometry.clusterSize = volume->bootSector.BytesPerSector * volume->bootSector.SectorPerCluster;
+	volume->geometry.clusterShift = log2OfPowerOfTwo(volume->geometry.clusterSize);
+	volume->geometry.clusterMask = volume->geometry.clusterSize - 1;
+	volume->geometry.dataStartSector = (int32_t) (volume->bootSector.SizeReservedArea + volume->bootSector.FatSize * volume->bootSector.NumFATs +
+	                                              (sizeof(struct SFN_t) * volume->bootSector.MaxNumOfFiles) / volume->bootSector.BytesPerSector);
+	volume->readClusters = selectReadClusters(&volume->geometry);
+
 	volume->FAT1 = (void *) calloc(volume->bootSector.FatSize, volume->bootSector.BytesPerSector);
 	if (volume->FAT1 == NULL) {
 		free(volume);
@@ -145,6 +194,19 @@ int fat_close(struct volume_t *pvolume) {
 	return 0;
 }
 
+bool isPowerOfTwo(uint32_t value) {
+	return value != 0 && (value & (value - 1)) == 0;
+}
+
+uint32_t log2OfPowerOfTwo(uint32_t value) {
+	uint32_t shift = 0;
+	while (value > 1) {
+		value >>= 1;
+		shift++;
+	}
+	return shift;
+}
+
 ////////////////////////////////////////////////////////////////////////////FILE_READER
 
 void fixFileName(const char *fileName, char fixedFileName[FILE_NAME_LENGTH]) {
@@ -230,8 +292,9 @@ struct file_t *file_open(struct volume_t *pvolume, const char *file_name) {
 	}
 
 	file->chain->clusterOffset = 0;
-	size_t clusterSize = file->volume->bootSector.BytesPerSector * file->volume->bootSector.SectorPerCluster;
-	file->chain->size = file->file_info.fileSize / (clusterSize);
+	file->chain->bufferedCluster = SIZE_MAX;
+	size_t clusterSize = pvolume->geometry.clusterSize;
+	file->chain->size = file->file_info.fileSize >> pvolume->geometry.clusterShift;
 
 	file->chain->clusterBuffer = calloc(1, (clusterSize) * sizeof(char));
 	if (file->chain->clusterBuffer == NULL) {
@@ -243,6 +306,85 @@ struct file_t *file_open(struct volume_t *pvolume, const char *file_name) {
 	return file;
 }
 
+/*
+ * Copies up to expectedBytes from the current offset cluster by cluster. Every per-geometry variant
+ * below inlines this with constant shift and sector count, so cluster index and in-cluster offset
+ * are plain shifts and masks; the generic variant serves the remaining sectors-per-cluster counts
+ * (1, 2, 128) and takes them from the precomputed volume geometry. Sectors are always SECTOR_SIZE bytes.
+ */
+static inline size_t read_clusters(char *buffer, size_t expectedBytes, struct file_t *stream, uint32_t clusterShift, uint32_t sectorsPerCluster) {
+	const size_t clusterSize = (size_t) 1 << clusterShift;
+	const size_t clusterMask = clusterSize - 1;
+	struct clusters_chain_t *chain = stream->chain;
+	size_t fileSize = stream->file_info.fileSize;
+	size_t bytesRead = 0;
+
+	while (stream->offset < fileSize && bytesRead < expectedBytes) {
+		size_t clusterNumber = stream->offset >> clusterShift;
+		if (chain->bufferedCluster != clusterNumber) {
+			int32_t sectorToRead = stream->volume->geometry.dataStartSector +
+			                       (int32_t) ((chain->clusters[clusterNumber] - FIRST_CLUSTER_OFFSET) * sectorsPerCluster);
+			if (disk_read(stream->volume->disk, sectorToRead, chain->clusterBuffer, (int32_t) sectorsPerCluster) == -1) {
+				chain->bufferedCluster = SIZE_MAX;
+				errno = ERANGE;
+				return (size_t) -1;
+			}
+			chain->bufferedCluster = clusterNumber;
+		}
+
+		chain->clusterOffset = stream->offset & clusterMask;
+		size_t toCopy = clusterSize - chain->clusterOffset;
+		if (toCopy > expectedBytes - bytesRead) {
+			toCopy = expectedBytes - bytesRead;
+		}
+		if (toCopy > fileSize - stream->offset) {
+			toCopy = fileSize - stream->offset;
+		}
+		memcpy(buffer + bytesRead, chain->clusterBuffer + chain->clusterOffset, toCopy);
+		chain->clusterOffset += toCopy;
+		stream->offset += toCopy;
+		bytesRead += toCopy;
+	}
+	return bytesRead;
+}
+
+static size_t read_clusters_generic(char *buffer, size_t expectedBytes, struct file_t *stream) {
+	return read_clusters(buffer, expectedBytes, stream, stream->volume->geometry.clusterShift, stream->volume->geometry.sectorsPerCluster);
+}
+
+#define DEFINE_READ_CLUSTERS(SPC, SHIFT)                                                                      \
+	static size_t read_clusters_512_##SPC(char *buffer, size_t expectedBytes, struct file_t *stream) { \
+		return read_clusters(buffer, expectedBytes, stream, SHIFT, SPC);                                 \
+	}
+
+DEFINE_READ_CLUSTERS(4, 11)
+DEFINE_READ_CLUSTERS(8, 12)
+DEFINE_READ_CLUSTERS(16, 13)
+DEFINE_READ_CLUSTERS(32, 14)
+DEFINE_READ_CLUSTERS(64, 15)
+
+#undef DEFINE_READ_CLUSTERS
+
+read_clusters_fn selectReadClusters(const struct fat_geometry_t *geometry) {
+	if (geometry == NULL) {
+		return NULL;
+	}
+	switch (geometry->sectorsPerCluster) {
+		case 4:
+			return read_clusters_512_4;
+		case 8:
+			return read_clusters_512_8;
+		case 16:
+			return read_clusters_512_16;
+		case 32:
+			return read_clusters_512_32;
+		case 64:
+			return read_clusters_512_64;
+		default:
+			return read_clusters_generic;
+	}
+}
+
 size_t file_read(void *ptr, size_t size, size_t nmemb, struct file_t *stream) {
 	if (ptr == NULL || stream == NULL) {
 		errno = EFAULT;
@@ -256,39 +398,9 @@ size_t file_read(void *ptr, size_t size, size_t nmemb, struct file_t *stream) {
 		return 0;
 	}
 
-	char *buffer = ptr;
-	size_t bytesRead = 0;
-	size_t expectedBytes = size * nmemb;
-	size_t clusterSize = stream->volume->bootSector.BytesPerSector * stream->volume->bootSector.SectorPerCluster;
-	size_t sectorSize = stream->volume->bootSector.BytesPerSector;
-	size_t sectorsToRead = clusterSize / sectorSize;
-
-	int clusterStartPosition = (int) (stream->volume->bootSector.SizeReservedArea + stream->volume->bootSector.FatSize * stream->volume->bootSector.NumFATs +
-	                                  (sizeof(struct SFN_t) * stream->volume->bootSector.MaxNumOfFiles) / sectorSize);
-
-	while (stream->offset <= stream->file_info.fileSize) {
-		if (stream->offset >= stream->file_info.fileSize || bytesRead >= size * nmemb) {
-			break;
-		}
-
-		int clusterNumber = (int) (stream->offset / clusterSize);
-		int sectorToRead = (int) (clusterStartPosition + (stream->chain->clusters[clusterNumber] - FIRST_CLUSTER_OFFSET) * sectorsToRead);
-		if (disk_read(stream->volume->disk, sectorToRead, stream->chain->clusterBuffer, (int) sectorsToRead) == -1) {
-			errno = ERANGE;
-			return -1;
-		}
-
-		stream->chain->clusterOffset = stream->offset % clusterSize;
-		if (stream->chain->clusterOffset == clusterSize) {
-			stream->chain->clusterOffset = 0;
-		}
-
-		while ((stream->chain->clusterOffset < clusterSize) && (bytesRead < expectedBytes) && (stream->offset < stream->file_info.fileSize)) {
-			buffer[bytesRead] = stream->chain->clusterBuffer[stream->chain->clusterOffset];
-			stream->chain->clusterOffset++;
-			stream->offset++;
-			bytesRead++;
-		}
+	size_t bytesRead = stream->volume->readClusters(ptr, size * nmemb, stream);
+	if (bytesRead == (size_t) -1) {
+		return -1;
 	}
 	return bytesRead / size;
 }
@@ -497,51 +609,1400 @@ int dir_close(struct dir_t *pdir) {
 	return 0;
 }
 
-/////////////////////////////////////////////////////////////////////////////////////////CLUSTERS_CHAIN
+/////////////////////////////////////////////////////////////////////////////////////////DIRECTORY_WALKER
 
-struct clusters_chain_t *get_chain_fat16(const void *const buffer, size_t size, uint16_t first_cluster) {
-	if (size == 0 || buffer == NULL || first_cluster == 0) {
-		return NULL;
+#define WALK_MAX_THREADS 64
+#define WALK_INITIAL_DEQUE_CAPACITY 16
+
+struct fat_timestamp_t decodeFatTimestamp(uint16_t date, uint16_t time) {
+	struct fat_timestamp_t timestamp;
+	timestamp.year = (uint16_t) (FAT_YEAR_BASE + (date >> 9));
+	timestamp.month = (uint8_t) ((date >> 5) & 0x0F);
+	timestamp.day = (uint8_t) (date & 0x1F);
+	timestamp.hours = (uint8_t) (time >> 11);
+	timestamp.minutes = (uint8_t) ((time >> 5) & 0x3F);
+	timestamp.seconds = (uint8_t) ((time & 0x1F) * 2);
+	return timestamp;
+}
+
+// Packs a timestamp the way it is stored on disk (date in the high half), so packed values compare chronologically.
+uint32_t encodeFatTimestamp(const struct fat_timestamp_t *timestamp) {
+	uint32_t year = timestamp->year > FAT_YEAR_BASE ? timestamp->year - FAT_YEAR_BASE : 0;
+	uint32_t date = (year << 9) | ((uint32_t) (timestamp->month & 0x0F) << 5) | (timestamp->day & 0x1F);
+	uint32_t time = ((uint32_t) (timestamp->hours & 0x1F) << 11) | ((uint32_t) (timestamp->minutes & 0x3F) << 5) | ((timestamp->seconds / 2) & 0x1F);
+	return (date << 16) | time;
+}
+
+static uint32_t rawFatTimestamp(const void *date, const void *time) {
+	uint16_t rawDate;
+	uint16_t rawTime;
+	memcpy(&rawDate, date, sizeof(uint16_t));
+	memcpy(&rawTime, time, sizeof(uint16_t));
+	return ((uint32_t) rawDate << 16) | rawTime;
+}
+
+bool matchNamePattern(const char *pattern, const char *name) {
+	const char *star = NULL;
+	const char *retry = NULL;
+	while (*name != '\0') {
+		if (*pattern == '*') {
+			star = pattern++;
+			retry = name;
+		} else if (*pattern == '?' || (*pattern != '\0' && toupper((unsigned char) *pattern) == toupper((unsigned char) *name))) {
+			pattern++;
+			name++;
+		} else if (star != NULL) {
+			pattern = star + 1;
+			name = ++retry;
+		} else {
+			return false;
+		}
 	}
-	const uint16_t *buffer_bytes = buffer;
-	struct clusters_chain_t *chain = malloc(sizeof(struct clusters_chain_t));
+	while (*pattern == '*') {
+		pattern++;
+	}
+	return *pattern == '\0';
+}
+
+void sfnToName(const struct SFN_t *entry, char name[13]) {
+	int length = 0;
+	for (int i = 0; i < DOT_OFFSET && entry->filename[i] != ' '; i++) {
+		name[length++] = entry->filename[i];
+	}
+	if (length > 0 && name[0] == 0x05) {
+		name[0] = FILE_DELETED;
+	}
+	if (entry->filename[DOT_OFFSET] != ' ') {
+		name[length++] = '.';
+		for (int i = DOT_OFFSET; i < FILE_NAME_LENGTH && entry->filename[i] != ' '; i++) {
+			name[length++] = entry->filename[i];
+		}
+	}
+	name[length] = '\0';
+}
+
+static bool isWalkableEntry(const struct SFN_t *entry) {
+	return entry->filename[0] != FILE_DELETED && entry->filename[0] != DOT_ENTRY &&
+	       entry->fileAttribute != LFN_ATTR_VALUE && (entry->fileAttribute & VOLUME_LABEL_ATTR_VALUE) == 0;
+}
+
+// Returns the entries of a directory in a freshly allocated buffer; first_cluster 0 is the root directory.
+static struct SFN_t *loadDirectory(struct volume_t *pvolume, uint16_t first_cluster, size_t *count) {
+	if (first_cluster == 0) {
+		size_t size = pvolume->bootSector.MaxNumOfFiles * sizeof(struct SFN_t);
+		struct SFN_t *entries = malloc(size);
+		if (entries == NULL) {
+			errno = ENOMEM;
+			return NULL;
+		}
+		memcpy(entries, pvolume->rootDirectory, size);
+		*count = pvolume->bootSector.MaxNumOfFiles;
+		return entries;
+	}
+
+	struct clusters_chain_t *chain = get_chain_fat16(pvolume->FAT1, pvolume->bootSector.FatSize * pvolume->bootSector.BytesPerSector, first_cluster);
 	if (chain == NULL) {
+		errno = EIO;
 		return NULL;
 	}
-	chain->clusters = malloc(sizeof(uint16_t));
-	if (chain->clusters == NULL) {
+	char *data = malloc(chain->size * pvolume->geometry.clusterSize);
+	if (data == NULL) {
+		free(chain->clusters);
 		free(chain);
+		errno = ENOMEM;
 		return NULL;
 	}
-	chain->size = 1;
-	chain->clusters[0] = first_cluster;
-	uint16_t current_cluster = *(buffer_bytes + first_cluster);
-	unsigned int first_fat_sector = (first_cluster * 2) / size;
-	while (current_cluster < 0xFFF8) {
-		uint8_t *FAT_table = malloc(sizeof(uint8_t) * size);
-		if (FAT_table == NULL) {
+	for (size_t i = 0; i < chain->size; i++) {
+		int32_t sector = pvolume->geometry.dataStartSector + (int32_t) ((chain->clusters[i] - FIRST_CLUSTER_OFFSET) * pvolume->geometry.sectorsPerCluster);
+		if (disk_pread(pvolume->disk, sector, data + (i << pvolume->geometry.clusterShift), (int32_t) pvolume->geometry.sectorsPerCluster) == -1) {
+			free(data);
 			free(chain->clusters);
 			free(chain);
+			errno = EIO;
 			return NULL;
 		}
-		uint16_t *tmp = realloc(chain->clusters, sizeof(uint16_t) * (chain->size + 2));
-		if (tmp == NULL) {
-			free(chain->clusters);
-			free(chain);
+	}
+	*count = (chain->size << pvolume->geometry.clusterShift) / sizeof(struct SFN_t);
+	free(chain->clusters);
+	free(chain);
+	return (struct SFN_t *) data;
+}
+
+static char *joinPath(const char *parent, const char *name) {
+	size_t parentLength = strlen(parent);
+	bool needsSeparator = parentLength == 0 || parent[parentLength - 1] != '\\';
+	char *path = malloc(parentLength + needsSeparator + strlen(name) + 1);
+	if (path == NULL) {
+		return NULL;
+	}
+	strcpy(path, parent);
+	if (needsSeparator) {
+		path[parentLength] = '\\';
+		path[parentLength + 1] = '\0';
+	}
+	strcat(path, name);
+	return path;
+}
+
+static bool walkEntryMatches(const struct dir_walk_filter_t *filter, const struct SFN_t *entry, const char *name) {
+	if (filter == NULL) {
+		return true;
+	}
+	if ((filter->flags & WALK_FILTER_MIN_SIZE) && entry->fileSize < filter->minSize) {
+		return false;
+	}
+	if ((filter->flags & WALK_FILTER_MAX_SIZE) && entry->fileSize > filter->maxSize) {
+		return false;
+	}
+	if ((filter->flags & WALK_FILTER_ATTRIBUTES) &&
+	    ((entry->fileAttribute & filter->attributesSet) != filter->attributesSet || (entry->fileAttribute & filter->attributesClear) != 0)) {
+		return false;
+	}
+	if (filter->flags & (WALK_FILTER_MODIFIED_AFTER | WALK_FILTER_MODIFIED_BEFORE)) {
+		uint32_t modified = rawFatTimestamp(&entry->lastModificationDate, &entry->lastModificationTime);
+		if ((filter->flags & WALK_FILTER_MODIFIED_AFTER) && modified < encodeFatTimestamp(&filter->modifiedAfter)) {
+			return false;
+		}
+		if ((filter->flags & WALK_FILTER_MODIFIED_BEFORE) && modified > encodeFatTimestamp(&filter->modifiedBefore)) {
+			return false;
+		}
+	}
+	if (filter->flags & (WALK_FILTER_CREATED_AFTER | WALK_FILTER_CREATED_BEFORE)) {
+		uint32_t created = rawFatTimestamp(&entry->creationDate, &entry->creationTime);
+		if ((filter->flags & WALK_FILTER_CREATED_AFTER) && created < encodeFatTimestamp(&filter->createdAfter)) {
+			return false;
+		}
+		if ((filter->flags & WALK_FILTER_CREATED_BEFORE) && created > encodeFatTimestamp(&filter->createdBefore)) {
+			return false;
+		}
+	}
+	if ((filter->flags & WALK_FILTER_NAME_PATTERN) && filter->namePattern != NULL && !matchNamePattern(filter->namePattern, name)) {
+		return false;
+	}
+	return true;
+}
+
+struct walk_job_t {
+	uint16_t firstCluster;
+	char *path;
+};
+
+struct walk_deque_t {
+	pthread_mutex_t lock;
+	struct walk_job_t *jobs;
+	size_t head;
+	size_t count;
+	size_t capacity;
+};
+
+struct walk_state_t {
+	struct volume_t *volume;
+	const struct dir_walk_filter_t *filter;
+	dir_walk_callback_t callback;
+	void *context;
+	int nthreads;
+	struct walk_deque_t *deques;
+	atomic_uchar *visited;
+	size_t visitedSize;
+	atomic_size_t pending;
+	atomic_size_t matched;
+	atomic_bool stop;
+	atomic_int error;
+	pthread_mutex_t callbackLock;
+	pthread_mutex_t idleLock;
+	pthread_cond_t idleCond;
+};
+
+struct walk_worker_t {
+	struct walk_state_t *state;
+	int index;
+	pthread_t thread;
+};
+
+static bool walkDequePush(struct walk_deque_t *deque, struct walk_job_t job) {
+	pthread_mutex_lock(&deque->lock);
+	if (deque->count == deque->capacity) {
+		size_t capacity = deque->capacity == 0 ? WALK_INITIAL_DEQUE_CAPACITY : deque->capacity * 2;
+		struct walk_job_t *jobs = malloc(capacity * sizeof(struct walk_job_t));
+		if (jobs == NULL) {
+			pthread_mutex_unlock(&deque->lock);
+			return false;
+		}
+		for (size_t i = 0; i < deque->count; i++) {
+			jobs[i] = deque->jobs[(deque->head + i) % deque->capacity];
+		}
+		free(deque->jobs);
+		deque->jobs = jobs;
+		deque->head = 0;
+		deque->capacity = capacity;
+	}
+	deque->jobs[(deque->head + deque->count) % deque->capacity] = job;
+	deque->count++;
+	pthread_mutex_unlock(&deque->lock);
+	return true;
+}
+
+// The owner takes the oldest job to keep the walk breadth-first; thieves take the newest one from the other end.
+static bool walkDequeTake(struct walk_deque_t *deque, struct walk_job_t *job, bool steal) {
+	pthread_mutex_lock(&deque->lock);
+	if (deque->count == 0) {
+		pthread_mutex_unlock(&deque->lock);
+		return false;
+	}
+	if (steal) {
+		*job = deque->jobs[(deque->head + deque->count - 1) % deque->capacity];
+	} else {
+		*job = deque->jobs[deque->head];
+		deque->head = (deque->head + 1) % deque->capacity;
+	}
+	deque->count--;
+	pthread_mutex_unlock(&deque->lock);
+	return true;
+}
+
+static bool walkTakeJob(struct walk_state_t *state, int index, struct walk_job_t *job) {
+	if (walkDequeTake(&state->deques[index], job, false)) {
+		return true;
+	}
+	for (int i = 1; i < state->nthreads; i++) {
+		if (walkDequeTake(&state->deques[(index + i) % state->nthreads], job, true)) {
+			return true;
+		}
+	}
+	return false;
+}
+
+static bool walkHasWork(struct walk_state_t *state) {
+	for (int i = 0; i < state->nthreads; i++) {
+		pthread_mutex_lock(&state->deques[i].lock);
+		size_t count = state->deques[i].count;
+		pthread_mutex_unlock(&state->deques[i].lock);
+		if (count != 0) {
+			return true;
+		}
+	}
+	return false;
+}
+
+static void walkWakeIdle(struct walk_state_t *state) {
+	pthread_mutex_lock(&state->idleLock);
+	pthread_cond_broadcast(&state->idleCond);
+	pthread_mutex_unlock(&state->idleLock);
+}
+
+static void walkFail(struct walk_state_t *state, int error) {
+	int expected = 0;
+	atomic_compare_exchange_strong(&state->error, &expected, error);
+	atomic_store(&state->stop, true);
+}
+
+static bool walkPushJob(struct walk_state_t *state, int index, uint16_t firstCluster, char *path) {
+	struct walk_job_t job = {firstCluster, path};
+	atomic_fetch_add(&state->pending, 1);
+	if (!walkDequePush(&state->deques[index], job)) {
+		atomic_fetch_sub(&state->pending, 1);
+		return false;
+	}
+	walkWakeIdle(state);
+	return true;
+}
+
+static void walkProcessJob(struct walk_state_t *state, int index, const struct walk_job_t *job) {
+	size_t count = 0;
+	struct SFN_t *entries = loadDirectory(state->volume, job->firstCluster, &count);
+	if (entries == NULL) {
+		walkFail(state, errno);
+		return;
+	}
+	bool decode = state->filter != NULL && (state->filter->flags & WALK_DECODE_TIMESTAMPS);
+
+	for (size_t i = 0; i < count && !atomic_load(&state->stop); i++) {
+		struct SFN_t *entry = &entries[i];
+		if (entry->filename[0] == LAST_ENTRY) {
+			break;
+		}
+		if (!isWalkableEntry(entry)) {
+			continue;
+		}
+		char name[13];
+		sfnToName(entry, name);
+		bool isDirectory = (entry->fileAttribute & DIR_ATTR_VALUE) != 0;
+		bool matches = walkEntryMatches(state->filter, entry, name);
+
+		bool descend = false;
+		if (isDirectory && entry->firstClusterNumberLowBits >= FIRST_CLUSTER_OFFSET && entry->firstClusterNumberLowBits < state->visitedSize) {
+			descend = atomic_exchange(&state->visited[entry->firstClusterNumberLowBits], 1) == 0;
+		}
+		if (!matches && !descend) {
+			continue;
+		}
+
+		char *path = joinPath(job->path, name);
+		if (path == NULL) {
+			walkFail(state, ENOMEM);
+			break;
+		}
+		if (matches) {
+			struct walk_entry_t walkEntry = {0};
+			walkEntry.path = path;
+			strcpy(walkEntry.name, name);
+			walkEntry.size = entry->fileSize;
+			walkEntry.firstCluster = entry->firstClusterNumberLowBits;
+			walkEntry.attributes = entry->fileAttribute;
+			walkEntry.is_directory = isDirectory;
+			if (decode) {
+				uint32_t modified = rawFatTimestamp(&entry->lastModificationDate, &entry->lastModificationTime);
+				uint32_t created = rawFatTimestamp(&entry->creationDate, &entry->creationTime);
+				walkEntry.modified = decodeFatTimestamp((uint16_t) (modified >> 16), (uint16_t) modified);
+				walkEntry.created = decodeFatTimestamp((uint16_t) (created >> 16), (uint16_t) created);
+			}
+			atomic_fetch_add(&state->matched, 1);
+			if (state->callback != NULL) {
+				pthread_mutex_lock(&state->callbackLock);
+				if (!atomic_load(&state->stop) && state->callback(&walkEntry, state->context) != 0) {
+					atomic_store(&state->stop, true);
+				}
+				pthread_mutex_unlock(&state->callbackLock);
+			}
+		}
+		if (descend && !atomic_load(&state->stop)) {
+			if (!walkPushJob(state, index, entry->firstClusterNumberLowBits, path)) {
+				free(path);
+				walkFail(state, ENOMEM);
+				break;
+			}
+			continue;
+		}
+		free(path);
+	}
+	free(entries);
+}
+
+static void *walkWorker(void *argument) {
+	struct walk_worker_t *worker = argument;
+	struct walk_state_t *state = worker->state;
+	for (;;) {
+		struct walk_job_t job;
+		if (walkTakeJob(state, worker->index, &job)) {
+			if (!atomic_load(&state->stop)) {
+				walkProcessJob(state, worker->index, &job);
+			}
+			free(job.path);
+			if (atomic_fetch_sub(&state->pending, 1) == 1) {
+				walkWakeIdle(state);
+			}
+			continue;
+		}
+		pthread_mutex_lock(&state->idleLock);
+		while (atomic_load(&state->pending) != 0 && !walkHasWork(state)) {
+			pthread_cond_wait(&state->idleCond, &state->idleLock);
+		}
+		bool done = atomic_load(&state->pending) == 0;
+		pthread_mutex_unlock(&state->idleLock);
+		if (done) {
 			return NULL;
 		}
-		chain->clusters = tmp;
-		unsigned int fat_offset = current_cluster * 2;
-		unsigned int fat_sector = first_fat_sector + (fat_offset / size);
-		unsigned int ent_offset = fat_offset % size;
-		memcpy(FAT_table, buffer_bytes + fat_sector, size);
-		chain->clusters[chain->size] = current_cluster;
-		unsigned short table_value = *(unsigned short *) (&FAT_table[ent_offset]);
-		current_cluster = table_value;
-		chain->size++;
-		free(FAT_table);
 	}
-	return chain;
 }
 
+// Resolves a \\DIR\\SUBDIR path to the first cluster of that directory; the root directory is cluster 0.
+static int resolveDirectory(struct volume_t *pvolume, const char *dir_path, uint16_t *first_cluster) {
+	if (*dir_path != '\\') {
+		errno = ENOTDIR;
+		return -1;
+	}
+	uint16_t cluster = 0;
+	const char *component = dir_path;
+	while (*component != '\0') {
+		while (*component == '\\') {
+			component++;
+		}
+		size_t length = strcspn(component, "\\");
+		if (length == 0) {
+			break;
+		}
+		size_t count = 0;
+		struct SFN_t *entries = loadDirectory(pvolume, cluster, &count);
+		if (entries == NULL) {
+			return -1;
+		}
+		bool found = false;
+		for (size_t i = 0; i < count && entries[i].filename[0] != LAST_ENTRY; i++) {
+			if (!isWalkableEntry(&entries[i])) {
+				continue;
+			}
+			char name[13];
+			sfnToName(&entries[i], name);
+			if (strlen(name) == length && strncasecmp(name, component, length) == 0) {
+				if ((entries[i].fileAttribute & DIR_ATTR_VALUE) == 0) {
+					free(entries);
+					errno = ENOTDIR;
+					return -1;
+				}
+				cluster = entries[i].firstClusterNumberLowBits;
+				found = true;
+				break;
+			}
+		}
+		free(entries);
+		if (!found) {
+			errno = ENOENT;
+			return -1;
+		}
+		component += length;
+	}
+	*first_cluster = cluster;
+	return 0;
+}
+
+int dir_walk(struct volume_t *pvolume, const char *root, const struct dir_walk_filter_t *filter,
+             dir_walk_callback_t callback, void *context, int nthreads) {
+	if (pvolume == NULL || root == NULL) {
+		errno = EFAULT;
+		return -1;
+	}
+	uint16_t rootCluster;
+	if (resolveDirectory(pvolume, root, &rootCluster) == -1) {
+		return -1;
+	}
+	if (nthreads <= 0) {
+		long online = sysconf(_SC_NPROCESSORS_ONLN);
+		nthreads = online > 0 ? (int) online : 1;
+	}
+	if (nthreads > WALK_MAX_THREADS) {
+		nthreads = WALK_MAX_THREADS;
+	}
+
+	struct walk_state_t state = {0};
+	state.volume = pvolume;
+	state.filter = filter;
+	state.callback = callback;
+	state.context = context;
+	state.nthreads = nthreads;
+	state.visitedSize = pvolume->bootSector.FatSize * pvolume->bootSector.BytesPerSector / sizeof(uint16_t);
+	state.visited = calloc(state.visitedSize, sizeof(atomic_uchar));
+	state.deques = calloc(nthreads, sizeof(struct walk_deque_t));
+	struct walk_worker_t *workers = calloc(nthreads, sizeof(struct walk_worker_t));
+	char *rootPath = joinPath("", "");
+	if (state.visited == NULL || state.deques == NULL || workers == NULL || rootPath == NULL) {
+		free(state.visited);
+		free(state.deques);
+		free(workers);
+		free(rootPath);
+		errno = ENOMEM;
+		return -1;
+	}
+	for (int i = 0; i < nthreads; i++) {
+		pthread_mutex_init(&state.deques[i].lock, NULL);
+	}
+	pthread_mutex_init(&state.callbackLock, NULL);
+	pthread_mutex_init(&state.idleLock, NULL);
+	pthread_cond_init(&state.idleCond, NULL);
+	if (rootCluster != 0 && rootCluster < state.visitedSize) {
+		atomic_store(&state.visited[rootCluster], 1);
+	}
+	if (rootCluster != 0) {
+		free(rootPath);
+		rootPath = joinPath(root, "");
+	}
+
+	if (rootPath == NULL || !walkPushJob(&state, 0, rootCluster, rootPath)) {
+		free(rootPath);
+		walkFail(&state, ENOMEM);
+	}
+
+	// The calling thread is worker 0; a worker that fails to start just leaves its share to be stolen.
+	int started = 1;
+	for (int i = 0; i < nthreads; i++) {
+		workers[i].state = &state;
+		workers[i].index = i;
+	}
+	for (int i = 1; i < nthreads; i++) {
+		if (pthread_create(&workers[i].thread, NULL, walkWorker, &workers[i]) != 0) {
+			break;
+		}
+		started++;
+	}
+	walkWorker(&workers[0]);
+	for (int i = 1; i < started; i++) {
+		pthread_join(workers[i].thread, NULL);
+	}
+
+	for (int i = 0; i < nthreads; i++) {
+		pthread_mutex_destroy(&state.deques[i].lock);
+		free(state.deques[i].jobs);
+	}
+	pthread_mutex_destroy(&state.callbackLock);
+	pthread_mutex_destroy(&state.idleLock);
+	pthread_cond_destroy(&state.idleCond);
+	free(state.visited);
+	free(state.deques);
+	free(workers);
+
+	int error = atomic_load(&state.error);
+	if (error != 0) {
+		errno = error;
+		return -1;
+	}
+	return (int) atomic_load(&state.matched);
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////CLUSTERS_CHAIN
 
+struct clusters_chain_t *get_chain_fat16(const void *const buffer, size_t size, uint16_t first_cluster) {
+	if (size == 0 || buffer == NULL || first_cluster == 0) {
+		return NULL;
+	}
+	const uint16_t *fat = buffer;
+	size_t entries = size / sizeof(uint16_t);
+	if (first_cluster >= entries) {
+		return NULL;
+	}
+	struct clusters_chain_t *chain = malloc(sizeof(struct clusters_chain_t));
+	if (chain == NULL) {
+		return NULL;
+	}
+	size_t capacity = 16;
+	chain->clusters = malloc(sizeof(uint16_t) * capacity);
+	if (chain->clusters == NULL) {
+		free(chain);
+		return NULL;
+	}
+	chain->size = 1;
+	chain->clusters[0] = first_cluster;
+	uint16_t current_cluster = fat[first_cluster];
+	while (current_cluster < 0xFFF8 && current_cluster < entries && chain->size < entries) {
+		if (chain->size == capacity) {
+			capacity *= 2;
+			uint16_t *tmp = realloc(chain->clusters, sizeof(uint16_t) * capacity);
+			if (tmp == NULL) {
+				free(chain->clusters);
+				free(chain);
+				return NULL;
+			}
+			chain->clusters = tmp;
+		}
+		chain->clusters[chain->size] = current_cluster;
+		current_cluster = fat[current_cluster];
+		chain->size++;
+	}
+	return chain;
+}
+/////////////////////////////////////////////////////////////////////////////////////////VOLUME_DIFF
+
+#define FNV_OFFSET_BASIS 0xcbf29ce484222325ULL
+#define FNV_PRIME 0x100000001b3ULL
+
+struct diff_entry_t {
+	char *path;
+	size_t size;
+	uint16_t firstCluster;
+	unsigned char attributes;
+	uint32_t modified;
+};
+
+struct diff_entry_list_t {
+	struct diff_entry_t *entries;
+	size_t count;
+	size_t capacity;
+};
+
+struct delta_writer_t {
+	FILE *file;
+	long runHeaderPosition;
+	uint32_t runFirstSector;
+	uint32_t runSectorCount;
+	uint32_t recordCount;
+	size_t bytes;
+};
+
+// Identifies the base image of a delta; it guards against applying to the wrong snapshot, not against tampering.
+uint64_t fingerprintSectors(const void *data, size_t size) {
+	const unsigned char *bytes = data;
+	uint64_t hash = FNV_OFFSET_BASIS;
+	for (size_t i = 0; i < size; i++) {
+		hash ^= bytes[i];
+		hash *= FNV_PRIME;
+	}
+	return hash;
+}
+
+bool isSameFile(FILE *file, const char *file_name) {
+	struct stat opened;
+	struct stat named;
+	if (file == NULL || file_name == NULL || fstat(fileno(file), &opened) != 0 || stat(file_name, &named) != 0) {
+		return false;
+	}
+	return opened.st_dev == named.st_dev && opened.st_ino == named.st_ino;
+}
+
+static int collectDiffEntry(const struct walk_entry_t *entry, void *context) {
+	struct diff_entry_list_t *list = context;
+	if (list->count == list->capacity) {
+		size_t capacity = list->capacity == 0 ? 64 : list->capacity * 2;
+		struct diff_entry_t *tmp = realloc(list->entries, capacity * sizeof(struct diff_entry_t));
+		if (tmp == NULL) {
+			return 1;
+		}
+		list->entries = tmp;
+		list->capacity = capacity;
+	}
+	struct diff_entry_t *item = &list->entries[list->count];
+	item->path = malloc(strlen(entry->path) + 1);
+	if (item->path == NULL) {
+		return 1;
+	}
+	strcpy(item->path, entry->path);
+	item->size = entry->size;
+	item->firstCluster = entry->firstCluster;
+	item->attributes = entry->attributes;
+	item->modified = encodeFatTimestamp(&entry->modified);
+	list->count++;
+	return 0;
+}
+
+static int compareDiffEntries(const void *a, const void *b) {
+	return strcmp(((const struct diff_entry_t *) a)->path, ((const struct diff_entry_t *) b)->path);
+}
+
+static void freeDiffEntries(struct diff_entry_list_t *list) {
+	for (size_t i = 0; i < list->count; i++) {
+		free(list->entries[i].path);
+	}
+	free(list->entries);
+}
+
+static int listVolumeEntries(struct volume_t *pvolume, struct diff_entry_list_t *list) {
+	struct dir_walk_filter_t filter = {0};
+	filter.flags = WALK_DECODE_TIMESTAMPS;
+	memset(list, 0, sizeof(struct diff_entry_list_t));
+	// Single worker: the callback appends to an unsynchronised list, and the pool would only add overhead here.
+	int found = dir_walk(pvolume, "\\", &filter, collectDiffEntry, list, 1);
+	if (found == -1 || (size_t) found != list->count) {
+		freeDiffEntries(list);
+		if (found != -1) {
+			errno = ENOMEM;
+		}
+		return -1;
+	}
+	qsort(list->entries, list->count, sizeof(struct diff_entry_t), compareDiffEntries);
+	return 0;
+}
+
+static void markChainCandidates(struct volume_t *pvolume, uint16_t first_cluster, bool *candidates, size_t clusterCount) {
+	if (first_cluster < FIRST_CLUSTER_OFFSET) {
+		return;
+	}
+	struct clusters_chain_t *chain = get_chain_fat16(pvolume->FAT1, pvolume->bootSector.FatSize * pvolume->bootSector.BytesPerSector, first_cluster);
+	if (chain == NULL) {
+		return;
+	}
+	for (size_t i = 0; i < chain->size; i++) {
+		if (chain->clusters[i] < clusterCount) {
+			candidates[chain->clusters[i]] = true;
+		}
+	}
+	free(chain->clusters);
+	free(chain);
+}
+
+static bool sameDiffEntry(const struct diff_entry_t *a, const struct diff_entry_t *b) {
+	return a->size == b->size && a->firstCluster == b->firstCluster && a->attributes == b->attributes && a->modified == b->modified;
+}
+
+// Merges the sorted entry lists of both volumes and marks the chains of added, modified and directory entries of the newer one.
+static size_t markEntryCandidates(struct volume_t *newer, const struct diff_entry_list_t *older, const struct diff_entry_list_t *current,
+                                  bool *candidates, size_t clusterCount) {
+	size_t changed = 0;
+	size_t i = 0;
+	size_t j = 0;
+	while (i < older->count || j < current->count) {
+		int order = i == older->count ? 1 : j == current->count ? -1 : strcmp(older->entries[i].path, current->entries[j].path);
+		if (order < 0) {
+			changed++;
+			i++;
+			continue;
+		}
+		const struct diff_entry_t *entry = &current->entries[j];
+		bool modified = order > 0 || !sameDiffEntry(&older->entries[i], entry);
+		if (modified) {
+			changed++;
+		}
+		// Directory clusters change whenever an entry inside them does, without touching the FAT or their own entry.
+		if (modified || (entry->attributes & DIR_ATTR_VALUE)) {
+			markChainCandidates(newer, entry->firstCluster, candidates, clusterCount);
+		}
+		if (order == 0) {
+			i++;
+		}
+		j++;
+	}
+	return changed;
+}
+
+static bool sameVolumeLayout(const struct volume_t *a, const struct volume_t *b) {
+	return a->bootSector.BytesPerSector == b->bootSector.BytesPerSector &&
+	       a->bootSector.SectorPerCluster == b->bootSector.SectorPerCluster &&
+	       a->bootSector.SizeReservedArea == b->bootSector.SizeReservedArea &&
+	       a->bootSector.NumFATs == b->bootSector.NumFATs &&
+	       a->bootSector.FatSize == b->bootSector.FatSize &&
+	       a->bootSector.MaxNumOfFiles == b->bootSector.MaxNumOfFiles;
+}
+
+static int deltaFlushRun(struct delta_writer_t *writer) {
+	if (writer->runSectorCount == 0) {
+		return 0;
+	}
+	long end = ftell(writer->file);
+	struct delta_record_t record = {writer->runFirstSector, writer->runSectorCount};
+	if (end == -1 || fseek(writer->file, writer->runHeaderPosition, SEEK_SET) != 0 ||
+	    fwrite(&record, sizeof(record), 1, writer->file) != 1 || fseek(writer->file, end, SEEK_SET) != 0) {
+		errno = EIO;
+		return -1;
+	}
+	writer->recordCount++;
+	writer->runSectorCount = 0;
+	return 0;
+}
+
+// Appends sectors to the delta, extending the open record when they follow it directly.
+static int deltaAppend(struct delta_writer_t *writer, uint32_t first_sector, const void *data, uint32_t sectors) {
+	if (writer->runSectorCount == 0 || writer->runFirstSector + writer->runSectorCount != first_sector) {
+		if (deltaFlushRun(writer) == -1) {
+			return -1;
+		}
+		struct delta_record_t placeholder = {first_sector, 0};
+		writer->runHeaderPosition = ftell(writer->file);
+		if (writer->runHeaderPosition == -1 || fwrite(&placeholder, sizeof(placeholder), 1, writer->file) != 1) {
+			errno = EIO;
+			return -1;
+		}
+		writer->runFirstSector = first_sector;
+		writer->bytes += sizeof(placeholder);
+	}
+	if (fwrite(data, SECTOR_SIZE, sectors, writer->file) != sectors) {
+		errno = EIO;
+		return -1;
+	}
+	writer->runSectorCount += sectors;
+	writer->bytes += (size_t) sectors * SECTOR_SIZE;
+	return 0;
+}
+
+static int deltaWriteMetadata(struct volume_t *older, struct volume_t *newer, struct delta_writer_t *writer, size_t *changedSectors,
+                              uint64_t *baseFingerprint) {
+	int32_t sectors = newer->geometry.dataStartSector;
+	char *oldData = malloc((size_t) sectors * SECTOR_SIZE);
+	char *newData = malloc((size_t) sectors * SECTOR_SIZE);
+	if (oldData == NULL || newData == NULL) {
+		free(oldData);
+		free(newData);
+		errno = ENOMEM;
+		return -1;
+	}
+	if (disk_pread(older->disk, 0, oldData, sectors) == -1 || disk_pread(newer->disk, 0, newData, sectors) == -1) {
+		free(oldData);
+		free(newData);
+		return -1;
+	}
+	*baseFingerprint = fingerprintSectors(oldData, (size_t) sectors * SECTOR_SIZE);
+	for (int32_t i = 0; i < sectors; i++) {
+		size_t offset = (size_t) i * SECTOR_SIZE;
+		if (memcmp(oldData + offset, newData + offset, SECTOR_SIZE) == 0) {
+			continue;
+		}
+		if (deltaAppend(writer, (uint32_t) i, newData + offset, 1) == -1) {
+			free(oldData);
+			free(newData);
+			return -1;
+		}
+		(*changedSectors)++;
+	}
+	free(oldData);
+	free(newData);
+	return 0;
+}
+
+static int deltaWriteClusters(struct volume_t *older, struct volume_t *newer, struct delta_writer_t *writer, const bool *candidates,
+                              size_t clusterCount, struct volume_diff_t *stats) {
+	size_t clusterSize = newer->geometry.clusterSize;
+	uint32_t sectorsPerCluster = newer->geometry.sectorsPerCluster;
+	char *oldCluster = malloc(clusterSize);
+	char *newCluster = malloc(clusterSize);
+	if (oldCluster == NULL || newCluster == NULL) {
+		free(oldCluster);
+		free(newCluster);
+		errno = ENOMEM;
+		return -1;
+	}
+	for (size_t cluster = FIRST_CLUSTER_OFFSET; cluster < clusterCount; cluster++) {
+		if (!candidates[cluster]) {
+			continue;
+		}
+		stats->candidateClusters++;
+		int32_t sector = newer->geometry.dataStartSector + (int32_t) ((cluster - FIRST_CLUSTER_OFFSET) * sectorsPerCluster);
+		if (disk_pread(newer->disk, sector, newCluster, (int32_t) sectorsPerCluster) == -1) {
+			free(oldCluster);
+			free(newCluster);
+			return -1;
+		}
+		bool changed = disk_pread(older->disk, sector, oldCluster, (int32_t) sectorsPerCluster) == -1 ||
+		               memcmp(oldCluster, newCluster, clusterSize) != 0;
+		if (!changed) {
+			continue;
+		}
+		if (deltaAppend(writer, (uint32_t) sector, newCluster, sectorsPerCluster) == -1) {
+			free(oldCluster);
+			free(newCluster);
+			return -1;
+		}
+		stats->changedClusters++;
+	}
+	free(oldCluster);
+	free(newCluster);
+	return 0;
+}
+
+/*
+ * Writes the sectors that turn the older image into the newer one. Candidate clusters are read from both images
+ * and compared byte for byte; free clusters of the newer volume are never exported. With DELTA_FULL_COMPARE the
+ * rebuilt image matches the newer one everywhere except in unallocated space. Without it, candidates come only
+ * from FAT and directory-entry differences, and in-place rewrites that touch neither are not picked up.
+ */
+int volume_delta_write(struct volume_t *older, struct volume_t *newer, const char *delta_file_name, int flags, struct volume_diff_t *stats) {
+	if (older == NULL || newer == NULL || delta_file_name == NULL) {
+		errno = EFAULT;
+		return -1;
+	}
+	// Opening the delta truncates it, which would wipe an input image named as the output.
+	if (!sameVolumeLayout(older, newer) || isSameFile(older->disk->pFile, delta_file_name) || isSameFile(newer->disk->pFile, delta_file_name)) {
+		errno = EINVAL;
+		return -1;
+	}
+	struct volume_diff_t localStats = {0};
+	if (stats == NULL) {
+		stats = &localStats;
+	}
+	memset(stats, 0, sizeof(struct volume_diff_t));
+
+	size_t fatEntries = newer->bootSector.FatSize * newer->bootSector.BytesPerSector / sizeof(uint16_t);
+	size_t dataClusters = (newer->disk->numberOfSectors - (uint32_t) newer->geometry.dataStartSector) / newer->geometry.sectorsPerCluster;
+	size_t clusterCount = dataClusters + FIRST_CLUSTER_OFFSET < fatEntries ? dataClusters + FIRST_CLUSTER_OFFSET : fatEntries;
+	bool *candidates = calloc(clusterCount, sizeof(bool));
+	if (candidates == NULL) {
+		errno = ENOMEM;
+		return -1;
+	}
+
+	const uint16_t *oldFat = older->FAT1;
+	const uint16_t *newFat = newer->FAT1;
+	for (size_t cluster = FIRST_CLUSTER_OFFSET; cluster < clusterCount; cluster++) {
+		if ((flags & DELTA_FULL_COMPARE) || oldFat[cluster] != newFat[cluster]) {
+			candidates[cluster] = true;
+		}
+	}
+
+	struct diff_entry_list_t oldEntries;
+	struct diff_entry_list_t newEntries;
+	if (listVolumeEntries(older, &oldEntries) == -1) {
+		free(candidates);
+		return -1;
+	}
+	if (listVolumeEntries(newer, &newEntries) == -1) {
+		freeDiffEntries(&oldEntries);
+		free(candidates);
+		return -1;
+	}
+	stats->changedEntries = markEntryCandidates(newer, &oldEntries, &newEntries, candidates, clusterCount);
+	freeDiffEntries(&oldEntries);
+	freeDiffEntries(&newEntries);
+
+	for (size_t cluster = FIRST_CLUSTER_OFFSET; cluster < clusterCount; cluster++) {
+		if (newFat[cluster] == FAT16_FREE_CLUSTER || newFat[cluster] == FAT16_BAD_CLUSTER) {
+			candidates[cluster] = false;
+		}
+	}
+
+	FILE *file = fopen(delta_file_name, "wb");
+	if (file == NULL) {
+		free(candidates);
+		return -1;
+	}
+	struct delta_header_t header = {0};
+	memcpy(header.magic, DELTA_MAGIC, DELTA_MAGIC_LENGTH);
+	header.version = DELTA_VERSION;
+	header.bytesPerSector = SECTOR_SIZE;
+	header.totalSectors = newer->disk->numberOfSectors;
+	header.baseTotalSectors = older->disk->numberOfSectors;
+	header.baseMetadataSectors = (uint32_t) older->geometry.dataStartSector;
+	struct delta_writer_t writer = {file, 0, 0, 0, 0, sizeof(header)};
+	uint64_t baseFingerprint = 0;
+
+	int result = -1;
+	if (fwrite(&header, sizeof(header), 1, file) == 1 &&
+	    deltaWriteMetadata(older, newer, &writer, &stats->changedMetadataSectors, &baseFingerprint) == 0 &&
+	    deltaWriteClusters(older, newer, &writer, candidates, clusterCount, stats) == 0 &&
+	    deltaFlushRun(&writer) == 0) {
+		header.recordCount = writer.recordCount;
+		header.baseFingerprint = baseFingerprint;
+		if (fseek(file, 0, SEEK_SET) == 0 && fwrite(&header, sizeof(header), 1, file) == 1) {
+			result = 0;
+		} else {
+			errno = EIO;
+		}
+	}
+	stats->deltaBytes = writer.bytes;
+	free(candidates);
+	if (fclose(file) != 0 && result == 0) {
+		errno = EIO;
+		result = -1;
+	}
+	return result;
+}
+
+static int copyImage(FILE *source, FILE *destination) {
+	char buffer[64 * SECTOR_SIZE];
+	size_t read;
+	while ((read = fread(buffer, 1, sizeof(buffer), source)) > 0) {
+		if (fwrite(buffer, 1, read, destination) != read) {
+			return -1;
+		}
+	}
+	return ferror(source) ? -1 : 0;
+}
+
+// Checks that the base image has the size and metadata fingerprint recorded in the delta, then rewinds it.
+static int checkDeltaBase(FILE *base, const struct delta_header_t *header) {
+	if (fseek(base, 0, SEEK_END) != 0 || ftell(base) != (long) header->baseTotalSectors * SECTOR_SIZE ||
+	    header->baseMetadataSectors > header->baseTotalSectors) {
+		return -1;
+	}
+	size_t size = (size_t) header->baseMetadataSectors * SECTOR_SIZE;
+	char *metadata = malloc(size);
+	if (metadata == NULL) {
+		return -1;
+	}
+	rewind(base);
+	int result = fread(metadata, 1, size, base) == size && fingerprintSectors(metadata, size) == header->baseFingerprint ? 0 : -1;
+	free(metadata);
+	rewind(base);
+	return result;
+}
+
+int volume_delta_apply(const char *base_file_name, const char *delta_file_name, const char *output_file_name) {
+	if (base_file_name == NULL || delta_file_name == NULL || output_file_name == NULL) {
+		errno = EFAULT;
+		return -1;
+	}
+	FILE *delta = fopen(delta_file_name, "rb");
+	if (delta == NULL) {
+		errno = ENOENT;
+		return -1;
+	}
+	struct delta_header_t header;
+	if (fread(&header, sizeof(header), 1, delta) != 1 || memcmp(header.magic, DELTA_MAGIC, DELTA_MAGIC_LENGTH) != 0 ||
+	    header.version != DELTA_VERSION || header.bytesPerSector != SECTOR_SIZE || header.totalSectors > MAX_NUM_OF_SECTORS_IN_FAT16) {
+		fclose(delta);
+		errno = EINVAL;
+		return -1;
+	}
+	FILE *base = fopen(base_file_name, "rb");
+	if (base == NULL) {
+		fclose(delta);
+		errno = ENOENT;
+		return -1;
+	}
+	if (checkDeltaBase(base, &header) == -1 || isSameFile(base, output_file_name) || isSameFile(delta, output_file_name)) {
+		fclose(base);
+		fclose(delta);
+		errno = EINVAL;
+		return -1;
+	}
+	FILE *output = fopen(output_file_name, "w+b");
+	if (output == NULL) {
+		fclose(base);
+		fclose(delta);
+		return -1;
+	}
+	int result = copyImage(base, output);
+	fclose(base);
+	if (result == 0 && (fflush(output) != 0 || ftruncate(fileno(output), (off_t) header.totalSectors * SECTOR_SIZE) != 0)) {
+		result = -1;
+	}
+
+	char sector[SECTOR_SIZE];
+	for (uint32_t i = 0; i < header.recordCount && result == 0; i++) {
+		struct delta_record_t record;
+		if (fread(&record, sizeof(record), 1, delta) != 1 || record.firstSector > header.totalSectors ||
+		    record.sectorCount > header.totalSectors - record.firstSector ||
+		    fseek(output, (long) record.firstSector * SECTOR_SIZE, SEEK_SET) != 0) {
+			result = -1;
+			break;
+		}
+		for (uint32_t j = 0; j < record.sectorCount; j++) {
+			if (fread(sector, SECTOR_SIZE, 1, delta) != 1 || fwrite(sector, SECTOR_SIZE, 1, output) != 1) {
+				result = -1;
+				break;
+			}
+		}
+	}
+	fclose(delta);
+	if (fclose(output) != 0) {
+		result = -1;
+	}
+	if (result == -1) {
+		errno = EIO;
+	}
+	return result;
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////DEFRAGMENTER
+
+size_t countChainExtents(const struct clusters_chain_t *chain) {
+	if (chain == NULL || chain->size == 0) {
+		return 0;
+	}
+	size_t extents = 1;
+	for (size_t i = 1; i < chain->size; i++) {
+		if (chain->clusters[i] != chain->clusters[i - 1] + 1) {
+			extents++;
+		}
+	}
+	return extents;
+}
+
+static size_t extentsBucket(size_t extents) {
+	size_t bucket = 0;
+	while (extents > 1 && bucket < FRAG_HISTOGRAM_BUCKETS - 1) {
+		extents = (extents + 1) / 2;
+		bucket++;
+	}
+	return bucket;
+}
+
+static void recordWorstFile(struct fragmentation_report_t *report, const char *path, size_t clusters, size_t extents) {
+	size_t position = report->worstCount;
+	while (position > 0 && report->worst[position - 1].extents < extents) {
+		position--;
+	}
+	if (position == FRAG_WORST_FILES) {
+		return;
+	}
+	size_t last = report->worstCount < FRAG_WORST_FILES ? report->worstCount : FRAG_WORST_FILES - 1;
+	memmove(&report->worst[position + 1], &report->worst[position], (last - position) * sizeof(struct fragmentation_file_t));
+	snprintf(report->worst[position].path, FRAG_MAX_PATH, "%s", path);
+	report->worst[position].clusters = clusters;
+	report->worst[position].extents = extents;
+	if (report->worstCount < FRAG_WORST_FILES) {
+		report->worstCount++;
+	}
+}
+
+struct fragmentation_context_t {
+	struct volume_t *volume;
+	struct fragmentation_report_t *report;
+	fragmentation_callback_t callback;
+	void *context;
+};
+
+static void countFragmentation(struct fragmentation_report_t *report, const struct fragmentation_file_t *entry) {
+	if (entry->is_directory) {
+		report->directories++;
+		if (!entry->is_resolved) {
+			report->unresolvedDirectories++;
+			return;
+		}
+		report->directoryClusters += entry->clusters;
+		report->directoryExtents += entry->extents;
+		if (entry->extents > 1) {
+			report->fragmentedDirectories++;
+		}
+		return;
+	}
+	report->files++;
+	if (!entry->is_resolved) {
+		return;
+	}
+	report->clusters += entry->clusters;
+	report->extents += entry->extents;
+	report->histogram[extentsBucket(entry->extents)]++;
+	if (entry->extents > 1) {
+		report->fragmentedFiles++;
+		recordWorstFile(report, entry->path, entry->clusters, entry->extents);
+	}
+}
+
+static int collectFragmentation(const struct walk_entry_t *entry, void *context) {
+	struct fragmentation_context_t *fragmentation = context;
+	struct volume_t *pvolume = fragmentation->volume;
+	struct fragmentation_file_t file = {0};
+	snprintf(file.path, FRAG_MAX_PATH, "%s", entry->path);
+	file.is_directory = entry->is_directory;
+
+	bool isEmpty = !entry->is_directory && entry->firstCluster == 0 && entry->size == 0;
+	struct clusters_chain_t *chain = NULL;
+	if (entry->firstCluster >= FIRST_CLUSTER_OFFSET) {
+		chain = get_chain_fat16(pvolume->FAT1, pvolume->bootSector.FatSize * pvolume->bootSector.BytesPerSector, entry->firstCluster);
+	}
+	if (chain != NULL) {
+		file.clusters = chain->size;
+		file.extents = countChainExtents(chain);
+		file.is_resolved = 1;
+		free(chain->clusters);
+		free(chain);
+	} else if (isEmpty) {
+		fragmentation->report->emptyFiles++;
+	} else if (!entry->is_directory) {
+		fragmentation->report->unresolvedFiles++;
+	}
+
+	countFragmentation(fragmentation->report, &file);
+	if (fragmentation->callback != NULL) {
+		return fragmentation->callback(&file, fragmentation->context);
+	}
+	return 0;
+}
+
+int fragmentation_report(struct volume_t *pvolume, struct fragmentation_report_t *report, fragmentation_callback_t callback, void *context) {
+	if (pvolume == NULL || report == NULL) {
+		errno = EFAULT;
+		return -1;
+	}
+	memset(report, 0, sizeof(struct fragmentation_report_t));
+	struct fragmentation_context_t fragmentation = {pvolume, report, callback, context};
+	// Chains are resolved inside the callback, which dir_walk serialises anyway, so one worker is enough.
+	if (dir_walk(pvolume, "\\", NULL, collectFragmentation, &fragmentation, 1) == -1) {
+		return -1;
+	}
+	return 0;
+}
+
+struct defrag_state_t {
+	struct volume_t *volume;
+	const uint16_t *fat;
+	uint16_t *newCluster;                   //old cluster -> new cluster, 0 while unassigned
+	bool *isDirectory;                      //indexed by old cluster
+	size_t clusterCount;
+	size_t nextFree;
+};
+
+static int defragAssignChain(struct defrag_state_t *state, uint16_t first_cluster, bool isDirectory) {
+	struct clusters_chain_t *chain = get_chain_fat16(state->fat, state->volume->bootSector.FatSize * state->volume->bootSector.BytesPerSector, first_cluster);
+	if (chain == NULL) {
+		errno = EIO;
+		return -1;
+	}
+	for (size_t i = 0; i < chain->size; i++) {
+		uint16_t cluster = chain->clusters[i];
+		if (cluster < FIRST_CLUSTER_OFFSET || cluster >= state->clusterCount || state->newCluster[cluster] != 0) {
+			continue;
+		}
+		while (state->nextFree < state->clusterCount && state->fat[state->nextFree] == FAT16_BAD_CLUSTER) {
+			state->nextFree++;
+		}
+		if (state->nextFree == state->clusterCount) {
+			free(chain->clusters);
+			free(chain);
+			errno = ENOSPC;
+			return -1;
+		}
+		state->newCluster[cluster] = (uint16_t) state->nextFree++;
+		state->isDirectory[cluster] = isDirectory;
+	}
+	free(chain->clusters);
+	free(chain);
+	return 0;
+}
+
+// Places every chain listed in the directory in entry order, then descends into the subdirectories placed here.
+static int defragLayoutDirectory(struct defrag_state_t *state, uint16_t dir_cluster) {
+	size_t count = 0;
+	struct SFN_t *entries = loadDirectory(state->volume, dir_cluster, &count);
+	if (entries == NULL) {
+		return -1;
+	}
+	uint16_t *subdirectories = malloc(count * sizeof(uint16_t));
+	if (subdirectories == NULL) {
+		free(entries);
+		errno = ENOMEM;
+		return -1;
+	}
+	size_t subdirectoryCount = 0;
+	for (size_t i = 0; i < count && entries[i].filename[0] != LAST_ENTRY; i++) {
+		uint16_t cluster = entries[i].firstClusterNumberLowBits;
+		if (!isWalkableEntry(&entries[i]) || cluster < FIRST_CLUSTER_OFFSET || cluster >= state->clusterCount || state->newCluster[cluster] != 0) {
+			continue;
+		}
+		bool isDirectory = (entries[i].fileAttribute & DIR_ATTR_VALUE) != 0;
+		if (defragAssignChain(state, cluster, isDirectory) == -1) {
+			free(subdirectories);
+			free(entries);
+			return -1;
+		}
+		if (isDirectory) {
+			subdirectories[subdirectoryCount++] = cluster;
+		}
+	}
+	free(entries);
+	for (size_t i = 0; i < subdirectoryCount; i++) {
+		if (defragLayoutDirectory(state, subdirectories[i]) == -1) {
+			free(subdirectories);
+			return -1;
+		}
+	}
+	free(subdirectories);
+	return 0;
+}
+
+static void defragRewriteEntries(const struct defrag_state_t *state, struct SFN_t *entries, size_t count) {
+	for (size_t i = 0; i < count && entries[i].filename[0] != LAST_ENTRY; i++) {
+		if (entries[i].filename[0] == FILE_DELETED || entries[i].fileAttribute == LFN_ATTR_VALUE) {
+			continue;
+		}
+		uint16_t cluster = entries[i].firstClusterNumberLowBits;
+		if (cluster >= FIRST_CLUSTER_OFFSET && cluster < state->clusterCount && state->newCluster[cluster] != 0) {
+			entries[i].firstClusterNumberLowBits = state->newCluster[cluster];
+		}
+	}
+}
+
+static int writeSectors(FILE *file, int32_t first_sector, const void *data, size_t sectors) {
+	if (fseek(file, (long) first_sector * SECTOR_SIZE, SEEK_SET) != 0 || fwrite(data, SECTOR_SIZE, sectors, file) != sectors) {
+		errno = EIO;
+		return -1;
+	}
+	return 0;
+}
+
+static int defragWriteTables(const struct defrag_state_t *state, FILE *output, char *reserved, uint16_t *fat, struct SFN_t *root) {
+	struct volume_t *pvolume = state->volume;
+	size_t rootEntries = pvolume->bootSector.MaxNumOfFiles;
+	int32_t rootSector = pvolume->bootSector.SizeReservedArea + pvolume->bootSector.FatSize * pvolume->bootSector.NumFATs;
+
+	if (disk_pread(pvolume->disk, 0, reserved, pvolume->bootSector.SizeReservedArea) == -1 ||
+	    writeSectors(output, 0, reserved, pvolume->bootSector.SizeReservedArea) == -1) {
+		return -1;
+	}
+
+	fat[0] = state->fat[0];
+	fat[1] = state->fat[1];
+	for (size_t old = FIRST_CLUSTER_OFFSET; old < state->clusterCount; old++) {
+		if (state->fat[old] == FAT16_BAD_CLUSTER) {
+			fat[old] = FAT16_BAD_CLUSTER;
+		}
+		if (state->newCluster[old] == 0) {
+			continue;
+		}
+		uint16_t next = state->fat[old];
+		if (next >= FAT16_END_OF_CHAIN) {
+			fat[state->newCluster[old]] = next;
+		} else if (next >= FIRST_CLUSTER_OFFSET && next < state->clusterCount && state->newCluster[next] != 0) {
+			fat[state->newCluster[old]] = state->newCluster[next];
+		} else {
+			fat[state->newCluster[old]] = 0xFFFF;
+		}
+	}
+	for (int i = 0; i < pvolume->bootSector.NumFATs; i++) {
+		if (writeSectors(output, pvolume->bootSector.SizeReservedArea + pvolume->bootSector.FatSize * i, fat, pvolume->bootSector.FatSize) == -1) {
+			return -1;
+		}
+	}
+
+	memcpy(root, pvolume->rootDirectory, rootEntries * sizeof(struct SFN_t));
+	defragRewriteEntries(state, root, rootEntries);
+	return writeSectors(output, rootSector, root, rootEntries * sizeof(struct SFN_t) / SECTOR_SIZE);
+}
+
+static int defragWriteClusters(const struct defrag_state_t *state, FILE *output, char *cluster) {
+	struct fat_geometry_t *geometry = &state->volume->geometry;
+	for (size_t old = FIRST_CLUSTER_OFFSET; old < state->clusterCount; old++) {
+		if (state->newCluster[old] == 0) {
+			continue;
+		}
+		int32_t source = geometry->dataStartSector + (int32_t) ((old - FIRST_CLUSTER_OFFSET) * geometry->sectorsPerCluster);
+		int32_t destination = geometry->dataStartSector + (int32_t) ((state->newCluster[old] - FIRST_CLUSTER_OFFSET) * geometry->sectorsPerCluster);
+		if (disk_pread(state->volume->disk, source, cluster, (int32_t) geometry->sectorsPerCluster) == -1) {
+			return -1;
+		}
+		if (state->isDirectory[old]) {
+			defragRewriteEntries(state, (struct SFN_t *) cluster, geometry->clusterSize / sizeof(struct SFN_t));
+		}
+		if (writeSectors(output, destination, cluster, geometry->sectorsPerCluster) == -1) {
+			return -1;
+		}
+	}
+	return 0;
+}
+
+static int defragWriteImage(const struct defrag_state_t *state, FILE *output) {
+	struct volume_t *pvolume = state->volume;
+	char *reserved = malloc((size_t) pvolume->bootSector.SizeReservedArea * SECTOR_SIZE);
+	uint16_t *fat = calloc(pvolume->bootSector.FatSize, pvolume->bootSector.BytesPerSector);
+	struct SFN_t *root = malloc(pvolume->bootSector.MaxNumOfFiles * sizeof(struct SFN_t));
+	char *cluster = malloc(pvolume->geometry.clusterSize);
+	int result = -1;
+	if (reserved == NULL || fat == NULL || root == NULL || cluster == NULL) {
+		errno = ENOMEM;
+	} else if (defragWriteTables(state, output, reserved, fat, root) == 0 && defragWriteClusters(state, output, cluster) == 0) {
+		result = 0;
+	}
+	free(reserved);
+	free(fat);
+	free(root);
+	free(cluster);
+	return result;
+}
+
+/*
+ * Writes a copy of the volume in which every reachable chain is contiguous, laid out in directory order with
+ * each directory followed by the chains it lists. Bad clusters keep their place, unreachable chains are dropped
+ * and free space is zeroed. The volume must start at sector 0 of its disk, like the rest of this reader assumes.
+ */
+int volume_defragment(struct volume_t *pvolume, const char *output_file_name) {
+	if (pvolume == NULL || output_file_name == NULL) {
+		errno = EFAULT;
+		return -1;
+	}
+	if (pvolume->bootSector.BytesPerSector != SECTOR_SIZE || isSameFile(pvolume->disk->pFile, output_file_name)) {
+		errno = EINVAL;
+		return -1;
+	}
+	size_t fatEntries = pvolume->bootSector.FatSize * pvolume->bootSector.BytesPerSector / sizeof(uint16_t);
+	size_t dataClusters = (pvolume->disk->numberOfSectors - (uint32_t) pvolume->geometry.dataStartSector) / pvolume->geometry.sectorsPerCluster;
+
+	struct defrag_state_t state = {0};
+	state.volume = pvolume;
+	state.fat = pvolume->FAT1;
+	state.clusterCount = dataClusters + FIRST_CLUSTER_OFFSET < fatEntries ? dataClusters + FIRST_CLUSTER_OFFSET : fatEntries;
+	state.nextFree = FIRST_CLUSTER_OFFSET;
+	state.newCluster = calloc(state.clusterCount, sizeof(uint16_t));
+	state.isDirectory = calloc(state.clusterCount, sizeof(bool));
+	if (state.newCluster == NULL || state.isDirectory == NULL) {
+		free(state.newCluster);
+		free(state.isDirectory);
+		errno = ENOMEM;
+		return -1;
+	}
+
+	int result = defragLayoutDirectory(&state, 0);
+	if (result == 0) {
+		FILE *output = fopen(output_file_name, "w+b");
+		if (output == NULL) {
+			result = -1;
+		} else {
+			if (ftruncate(fileno(output), (off_t) pvolume->disk->numberOfSectors * SECTOR_SIZE) != 0) {
+				errno = EIO;
+				result = -1;
+			} else {
+				result = defragWriteImage(&state, output);
+			}
+			if (fclose(output) != 0 && result == 0) {
+				errno = EIO;
+				result = -1;
+			}
+		}
+	}
+	free(state.newCluster);
+	free(state.isDirectory);
+	return result;
+}
@@ -36,6 +36,28 @@
 #define IS_VOLUME_LABEL 3
 #define IS_DIRECTORY 4
 #define IS_ARCHIVED 5
+#define LFN_ATTR_VALUE 0x0F
+#define DOT_ENTRY '.'
+#define FAT_YEAR_BASE 1980
+#define WALK_FILTER_MIN_SIZE (1 << 0)
+#define WALK_FILTER_MAX_SIZE (1 << 1)
+#define WALK_FILTER_MODIFIED_AFTER (1 << 2)
+#define WALK_FILTER_MODIFIED_BEFORE (1 << 3)
+#define WALK_FILTER_CREATED_AFTER (1 << 4)
+#define WALK_FILTER_CREATED_BEFORE (1 << 5)
+#define WALK_FILTER_ATTRIBUTES (1 << 6)
+#define WALK_FILTER_NAME_PATTERN (1 << 7)
+#define WALK_DECODE_TIMESTAMPS (1 << 8)
+#define FAT16_FREE_CLUSTER 0x0000
+#define DELTA_MAGIC "FAT16DLT"
+#define DELTA_MAGIC_LENGTH 8
+#define DELTA_VERSION 2
+#define DELTA_FULL_COMPARE (1 << 0)
+#define FAT16_BAD_CLUSTER 0xFFF7
+#define FAT16_END_OF_CHAIN 0xFFF8
+#define FRAG_HISTOGRAM_BUCKETS 8
+#define FRAG_WORST_FILES 10
+#define FRAG_MAX_PATH 256
 
 typedef struct fatBootSector {
 	unsigned char jmpBoot[3];               //0-2	Assembly code instructions to jump to boot code (mandatory in bootable partition)
@@ -76,22 +98,45 @@ int disk_read(struct disk_t *pdisk, int32_t first_sector, void *buffer, int32_t
 
 int disk_close(struct disk_t *pdisk);
 
+int disk_pread(struct disk_t *pdisk, int32_t first_sector, void *buffer, int32_t sectors_to_read);
+
+struct file_t;
+
+typedef size_t (*read_clusters_fn)(char *buffer, size_t expectedBytes, struct file_t *stream);
+
+struct fat_geometry_t {
+	uint32_t clusterSize;           //BytesPerSector * SectorPerCluster
+	uint32_t clusterShift;          //log2(clusterSize)
+	uint32_t clusterMask;           //clusterSize - 1
+	uint32_t sectorsPerCluster;
+	int32_t dataStartSector;        //first sector of cluster 2
+};
+
 struct volume_t {
 	struct disk_t *disk;
 	struct fatBootSector bootSector;
 	void *FAT1;
 	void *FAT2;
 	void *rootDirectory;
+	struct fat_geometry_t geometry;
+	read_clusters_fn readClusters;  //chosen by fat_open for the detected geometry
 };
 
 struct volume_t *fat_open(struct disk_t *pdisk, uint32_t first_sector);
 
 int fat_close(struct volume_t *pvolume);
 
+bool isPowerOfTwo(uint32_t value);
+
+uint32_t log2OfPowerOfTwo(uint32_t value);
+
+read_clusters_fn selectReadClusters(const struct fat_geometry_t *geometry);
+
 struct clusters_chain_t {
 	uint16_t *clusters;
 	char *clusterBuffer;
 	size_t clusterOffset;
+	size_t bufferedCluster;         //index of the cluster held in clusterBuffer, SIZE_MAX if none
 	size_t size;
 };
 
@@ -170,5 +215,121 @@ void fixDirName(char *dirName, char fixedDirName[13], int isDirectory);
 
 void addOffsetAndChangeDirAttr(struct dir_t *pdir);
 
+struct fat_timestamp_t {
+	uint16_t year;
+	uint8_t month;
+	uint8_t day;
+	uint8_t hours;
+	uint8_t minutes;
+	uint8_t seconds;
+};
+
+struct dir_walk_filter_t {
+	int flags;                              //WALK_FILTER_* predicates to apply, WALK_DECODE_TIMESTAMPS to fill timestamps
+	size_t minSize;
+	size_t maxSize;
+	struct fat_timestamp_t modifiedAfter;   //bounds are inclusive
+	struct fat_timestamp_t modifiedBefore;
+	struct fat_timestamp_t createdAfter;
+	struct fat_timestamp_t createdBefore;
+	unsigned char attributesSet;            //every bit here must be set
+	unsigned char attributesClear;          //every bit here must be clear
+	const char *namePattern;                //'*' and '?' wildcards, case insensitive, matched against NAME.EXT
+};
+
+struct walk_entry_t {
+	const char *path;                       //full path, e.g. \SUB\FILE.TXT
+	char name[13];
+	size_t size;
+	uint16_t firstCluster;
+	unsigned char attributes;
+	int is_directory;
+	struct fat_timestamp_t modified;        //zeroed unless WALK_DECODE_TIMESTAMPS
+	struct fat_timestamp_t created;
+};
+
+typedef int (*dir_walk_callback_t)(const struct walk_entry_t *entry, void *context);
+
+int dir_walk(struct volume_t *pvolume, const char *root, const struct dir_walk_filter_t *filter,
+             dir_walk_callback_t callback, void *context, int nthreads);
+
+struct fat_timestamp_t decodeFatTimestamp(uint16_t date, uint16_t time);
+
+uint32_t encodeFatTimestamp(const struct fat_timestamp_t *timestamp);
+
+bool matchNamePattern(const char *pattern, const char *name);
+
+void sfnToName(const struct SFN_t *entry, char name[13]);
+
+struct delta_header_t {
+	char magic[DELTA_MAGIC_LENGTH];         //DELTA_MAGIC
+	uint16_t version;                       //DELTA_VERSION
+	uint16_t bytesPerSector;
+	uint32_t totalSectors;                  //size of the newer image, in sectors
+	uint32_t recordCount;
+	uint32_t baseTotalSectors;              //size of the image the delta applies to
+	uint32_t baseMetadataSectors;           //boot sector, reserved area, FATs and root directory
+	uint64_t baseFingerprint;               //FNV-1a of the base metadata sectors
+}__attribute__((__packed__));
+
+struct delta_record_t {
+	uint32_t firstSector;
+	uint32_t sectorCount;                   //followed by sectorCount * bytesPerSector bytes of data
+}__attribute__((__packed__));
+
+struct volume_diff_t {
+	size_t changedEntries;                  //directory entries added, removed or modified
+	size_t changedMetadataSectors;          //boot sector, reserved area, FATs and root directory
+	size_t candidateClusters;               //clusters whose content was compared
+	size_t changedClusters;
+	size_t deltaBytes;
+};
+
+/*
+ * By default only clusters reached through changed FAT entries, added or modified directory entries and
+ * directory chains are compared, so a cluster rewritten in place with its FAT entry and directory entry
+ * left untouched is missed. DELTA_FULL_COMPARE compares every allocated cluster instead.
+ */
+int volume_delta_write(struct volume_t *older, struct volume_t *newer, const char *delta_file_name, int flags, struct volume_diff_t *stats);
+
+int volume_delta_apply(const char *base_file_name, const char *delta_file_name, const char *output_file_name);
+
+uint64_t fingerprintSectors(const void *data, size_t size);
+
+bool isSameFile(FILE *file, const char *file_name);
+
+struct fragmentation_file_t {
+	char path[FRAG_MAX_PATH];
+	size_t clusters;
+	size_t extents;                         //runs of consecutive clusters in the chain
+	int is_directory;
+	int is_resolved;                        //0 for empty files and chains that could not be read from the FAT
+};
+
+struct fragmentation_report_t {
+	size_t files;                           //every file entry, including the two counters below
+	size_t emptyFiles;                      //zero-length files without a cluster chain
+	size_t unresolvedFiles;                 //files whose cluster chain could not be read from the FAT
+	size_t fragmentedFiles;                 //files with more than one extent
+	size_t clusters;
+	size_t extents;
+	size_t histogram[FRAG_HISTOGRAM_BUCKETS];   //resolved files with 1, 2, 3-4, 5-8, 9-16, 17-32, 33-64 and more extents
+	struct fragmentation_file_t worst[FRAG_WORST_FILES];   //files with the most extents first
+	size_t worstCount;
+	size_t directories;                     //subdirectories; the fixed root directory has no chain
+	size_t unresolvedDirectories;
+	size_t fragmentedDirectories;
+	size_t directoryClusters;
+	size_t directoryExtents;
+};
+
+typedef int (*fragmentation_callback_t)(const struct fragmentation_file_t *entry, void *context);
+
+size_t countChainExtents(const struct clusters_chain_t *chain);
+
+// callback, when not NULL, receives the extents of every file and subdirectory; a non-zero return stops the scan.
+int fragmentation_report(struct volume_t *pvolume, struct fragmentation_report_t *report, fragmentation_callback_t callback, void *context);
+
+int volume_defragment(struct volume_t *pvolume, const char *output_file_name);
 
 #endif //PROJECT1_FILE_READER_H
@@ -0,0 +1,434 @@
+//
+// Self-test driver for the directory walker, the delta writer and the defragmenter.
+//
+// Run tests/run_tests.sh, which generates images with tests/mkimage.py and runs this driver on each:
+//   fat16_selftest <image> <scratch_directory>
+//
+
+#define _XOPEN_SOURCE 700
+
+#include "file_reader.h"
+#include <stddef.h>
+
+#define WALK_REPEATS 200
+#define WALK_MAX_ENTRIES 256
+#define PATH_LENGTH 4096
+
+static int failures = 0;
+
+#define CHECK(condition, ...)                                \
+	do {                                                     \
+		if (!(condition)) {                                  \
+			failures++;                                      \
+			printf("FAIL %s:%d: ", __FILE__, __LINE__);      \
+			printf(__VA_ARGS__);                             \
+			printf("\n");                                    \
+		}                                                    \
+	} while (0)
+
+struct walk_item_t {
+	char path[FRAG_MAX_PATH];
+	uint16_t firstCluster;
+	size_t size;
+	int is_directory;
+};
+
+struct walk_list_t {
+	struct walk_item_t items[WALK_MAX_ENTRIES];
+	size_t count;
+};
+
+static int collectWalkEntry(const struct walk_entry_t *entry, void *context) {
+	struct walk_list_t *list = context;
+	if (list->count == WALK_MAX_ENTRIES) {
+		return 1;
+	}
+	struct walk_item_t *item = &list->items[list->count++];
+	snprintf(item->path, FRAG_MAX_PATH, "%s", entry->path);
+	item->firstCluster = entry->firstCluster;
+	item->size = entry->size;
+	item->is_directory = entry->is_directory;
+	return 0;
+}
+
+static int compareItems(const void *a, const void *b) {
+	return strcmp(((const struct walk_item_t *) a)->path, ((const struct walk_item_t *) b)->path);
+}
+
+static const struct walk_item_t *findItem(const struct walk_list_t *list, const char *path) {
+	for (size_t i = 0; i < list->count; i++) {
+		if (strcmp(list->items[i].path, path) == 0) {
+			return &list->items[i];
+		}
+	}
+	return NULL;
+}
+
+static bool sameWalk(const struct walk_list_t *a, const struct walk_list_t *b) {
+	if (a->count != b->count) {
+		return false;
+	}
+	for (size_t i = 0; i < a->count; i++) {
+		if (strcmp(a->items[i].path, b->items[i].path) != 0) {
+			return false;
+		}
+	}
+	return true;
+}
+
+static int walkSorted(struct volume_t *volume, const char *root, const struct dir_walk_filter_t *filter, int nthreads, struct walk_list_t *list) {
+	list->count = 0;
+	int found = dir_walk(volume, root, filter, collectWalkEntry, list, nthreads);
+	qsort(list->items, list->count, sizeof(struct walk_item_t), compareItems);
+	return found;
+}
+
+static struct volume_t *openImage(const char *file_name) {
+	struct disk_t *disk = disk_open_from_file(file_name);
+	if (disk == NULL) {
+		return NULL;
+	}
+	struct volume_t *volume = fat_open(disk, 0);
+	if (volume == NULL) {
+		disk_close(disk);
+	}
+	return volume;
+}
+
+static void closeImage(struct volume_t *volume) {
+	if (volume != NULL) {
+		struct disk_t *disk = volume->disk;
+		fat_close(volume);
+		disk_close(disk);
+	}
+}
+
+static int copyFile(const char *source, const char *destination) {
+	FILE *input = fopen(source, "rb");
+	FILE *output = fopen(destination, "wb");
+	int result = input != NULL && output != NULL ? 0 : -1;
+	char buffer[64 * SECTOR_SIZE];
+	size_t read;
+	while (result == 0 && (read = fread(buffer, 1, sizeof(buffer), input)) > 0) {
+		if (fwrite(buffer, 1, read, output) != read) {
+			result = -1;
+		}
+	}
+	if (input != NULL) {
+		fclose(input);
+	}
+	if (output != NULL && fclose(output) != 0) {
+		result = -1;
+	}
+	return result;
+}
+
+static bool sameContents(const char *a, const char *b) {
+	FILE *first = fopen(a, "rb");
+	FILE *second = fopen(b, "rb");
+	bool same = first != NULL && second != NULL;
+	while (same) {
+		int x = fgetc(first);
+		int y = fgetc(second);
+		same = x == y;
+		if (x == EOF || y == EOF) {
+			break;
+		}
+	}
+	if (first != NULL) {
+		fclose(first);
+	}
+	if (second != NULL) {
+		fclose(second);
+	}
+	return same;
+}
+
+static int patchFile(const char *file_name, long offset, const void *data, size_t size) {
+	FILE *file = fopen(file_name, "r+b");
+	if (file == NULL) {
+		return -1;
+	}
+	int result = fseek(file, offset, SEEK_SET) == 0 && fwrite(data, 1, size, file) == size ? 0 : -1;
+	return fclose(file) != 0 ? -1 : result;
+}
+
+static long clusterOffset(const struct volume_t *volume, uint16_t cluster) {
+	return (long) (volume->geometry.dataStartSector + (int32_t) ((cluster - FIRST_CLUSTER_OFFSET) * volume->geometry.sectorsPerCluster)) * SECTOR_SIZE;
+}
+
+// Byte offset of the index-th cluster of a root-level file, or -1 when the chain is shorter.
+static long fileClusterOffset(struct volume_t *volume, const char *name, size_t index) {
+	struct file_t *file = file_open(volume, name);
+	if (file == NULL) {
+		return -1;
+	}
+	struct clusters_chain_t *chain = get_chain_fat16(volume->FAT1, volume->bootSector.FatSize * volume->bootSector.BytesPerSector,
+	                                                 file->file_info.firstClusterNumberLowBits);
+	long offset = chain != NULL && index < chain->size ? clusterOffset(volume, chain->clusters[index]) : -1;
+	if (chain != NULL) {
+		free(chain->clusters);
+		free(chain);
+	}
+	file_close(file);
+	return offset;
+}
+
+static long rootEntryOffset(const struct volume_t *volume, const char *sfn_name) {
+	const struct SFN_t *root = volume->rootDirectory;
+	for (unsigned i = 0; i < volume->bootSector.MaxNumOfFiles; i++) {
+		if (strncmp(root[i].filename, sfn_name, FILE_NAME_LENGTH) == 0) {
+			long rootSector = volume->bootSector.SizeReservedArea + volume->bootSector.FatSize * volume->bootSector.NumFATs;
+			return rootSector * SECTOR_SIZE + (long) (i * sizeof(struct SFN_t));
+		}
+	}
+	return -1;
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////WALKER
+
+static void testWalker(struct volume_t *volume) {
+	static struct walk_list_t reference;
+	static struct walk_list_t parallel;
+	int found = walkSorted(volume, "\\", NULL, 1, &reference);
+	CHECK(found == (int) reference.count && found > 0, "single-threaded walk returned %d for %zu entries", found, reference.count);
+	CHECK(findItem(&reference, "\\SUB\\INNER\\DEEP.TXT") != NULL, "walk misses the nested file");
+	CHECK(findItem(&reference, "\\GONE.TXT") == NULL, "walk reports a deleted entry");
+	CHECK(findItem(&reference, "\\SELFTEST") == NULL, "walk reports the volume label");
+
+	for (int i = 0; i < WALK_REPEATS; i++) {
+		int nthreads = 2 + i % 7;
+		found = walkSorted(volume, "\\", NULL, nthreads, &parallel);
+		CHECK(found == (int) reference.count && sameWalk(&parallel, &reference),
+		      "%d-thread walk differs from the single-threaded one", nthreads);
+	}
+
+	found = walkSorted(volume, "\\sub", NULL, 4, &parallel);
+	CHECK(found == 7 && strcmp(parallel.items[0].path, "\\sub\\F0.TXT") == 0, "walk from \\sub returned %d entries", found);
+	CHECK(dir_walk(volume, "\\NOPE", NULL, NULL, NULL, 2) == -1 && errno == ENOENT, "missing root is not ENOENT");
+	CHECK(dir_walk(volume, "\\BIG.BIN", NULL, NULL, NULL, 2) == -1 && errno == ENOTDIR, "file root is not ENOTDIR");
+
+	struct dir_walk_filter_t filter = {0};
+	filter.flags = WALK_FILTER_NAME_PATTERN | WALK_FILTER_MIN_SIZE | WALK_FILTER_ATTRIBUTES;
+	filter.namePattern = "*.txt";
+	filter.minSize = 10000;
+	filter.attributesClear = DIR_ATTR_VALUE;
+	found = walkSorted(volume, "\\", &filter, 4, &parallel);
+	CHECK(found == 6, "*.txt >= 10000 matched %d entries, expected 6", found);
+
+	filter.flags = WALK_FILTER_ATTRIBUTES;
+	filter.attributesSet = 1 << READ_ONLY;
+	filter.attributesClear = 0;
+	found = walkSorted(volume, "\\", &filter, 4, &parallel);
+	CHECK(found == 1 && strcmp(parallel.items[0].path, "\\SUB\\INNER\\DEEP.TXT") == 0, "read-only filter matched %d entries", found);
+
+	struct fat_timestamp_t after = {2024, 1, 2, 0, 0, 0};
+	filter.flags = WALK_FILTER_MODIFIED_AFTER;
+	filter.modifiedAfter = after;
+	CHECK(walkSorted(volume, "\\", &filter, 4, &parallel) == 0, "modified-after filter matched entries from 2024-01-01");
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////DELTA
+
+static int writeDelta(const char *older_name, const char *newer_name, const char *delta_name, int flags, struct volume_diff_t *stats) {
+	struct volume_t *older = openImage(older_name);
+	struct volume_t *newer = openImage(newer_name);
+	int result = older != NULL && newer != NULL ? volume_delta_write(older, newer, delta_name, flags, stats) : -1;
+	closeImage(older);
+	closeImage(newer);
+	return result;
+}
+
+static void testDelta(struct volume_t *volume, const char *image, const char *scratch) {
+	char newer[PATH_LENGTH];
+	char inPlace[PATH_LENGTH];
+	char delta[PATH_LENGTH];
+	char rebuilt[PATH_LENGTH];
+	snprintf(newer, sizeof(newer), "%s/delta_newer.img", scratch);
+	snprintf(inPlace, sizeof(inPlace), "%s/delta_in_place.img", scratch);
+	snprintf(delta, sizeof(delta), "%s/image.delta", scratch);
+	snprintf(rebuilt, sizeof(rebuilt), "%s/delta_rebuilt.img", scratch);
+	struct volume_diff_t stats;
+
+	CHECK(writeDelta(image, image, delta, 0, &stats) == 0 && stats.changedClusters == 0 && stats.changedMetadataSectors == 0,
+	      "identical images produced a non-empty delta");
+	CHECK(volume_delta_apply(image, delta, rebuilt) == 0 && sameContents(rebuilt, image), "empty delta does not rebuild the image");
+
+	// A rewritten MED.TXT cluster with a new modification date is found without DELTA_FULL_COMPARE.
+	uint16_t newDate = ((2025 - FAT_YEAR_BASE) << 9) | (6 << 5) | 15;
+	long medCluster = fileClusterOffset(volume, "MED.TXT", 1);
+	long medEntry = rootEntryOffset(volume, "MED     TXT");
+	CHECK(copyFile(image, newer) == 0 && medCluster != -1 && medEntry != -1 &&
+	      patchFile(newer, medCluster + 100, "CHANGED", 7) == 0 &&
+	      patchFile(newer, medEntry + (long) offsetof(struct SFN_t, lastModificationDate), &newDate, sizeof(newDate)) == 0,
+	      "could not prepare the modified image");
+	CHECK(writeDelta(image, newer, delta, 0, &stats) == 0 && stats.changedEntries == 1 && stats.changedClusters == 1,
+	      "modified file: %zu entries, %zu clusters changed", stats.changedEntries, stats.changedClusters);
+	CHECK(volume_delta_apply(image, delta, rebuilt) == 0 && sameContents(rebuilt, newer), "delta does not rebuild the modified image");
+
+	// An in-place rewrite that leaves the FAT and the directory entry alone needs DELTA_FULL_COMPARE.
+	long oddCluster = fileClusterOffset(volume, "ODD.BIN", 1);
+	CHECK(copyFile(image, inPlace) == 0 && oddCluster != -1 && patchFile(inPlace, oddCluster, "ZZZZ", 4) == 0,
+	      "could not prepare the in-place image");
+	CHECK(writeDelta(image, inPlace, delta, DELTA_FULL_COMPARE, &stats) == 0 && stats.changedClusters == 1,
+	      "full compare found %zu changed clusters", stats.changedClusters);
+	CHECK(volume_delta_apply(image, delta, rebuilt) == 0 && sameContents(rebuilt, inPlace), "full-compare delta does not rebuild the image");
+
+	CHECK(volume_delta_apply(newer, delta, rebuilt) == -1 && errno == EINVAL, "delta applied to the wrong base");
+	CHECK(writeDelta(image, newer, newer, 0, &stats) == -1 && errno == EINVAL, "delta path naming the newer image accepted");
+	CHECK(volume_delta_apply(image, delta, delta) == -1 && errno == EINVAL, "output path naming the delta accepted");
+	CHECK(volume_delta_apply(image, delta, image) == -1 && errno == EINVAL, "output path naming the base accepted");
+	CHECK(volume_delta_apply(image, delta, rebuilt) == 0 && sameContents(rebuilt, inPlace), "rejected calls damaged the inputs");
+
+	// A record whose sector count wraps past totalSectors must be rejected.
+	struct delta_record_t record = {10, 0xFFFFFFFFu};
+	CHECK(patchFile(delta, (long) sizeof(struct delta_header_t), &record, sizeof(record)) == 0 &&
+	      volume_delta_apply(image, delta, rebuilt) == -1, "wrapping delta record accepted");
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////DEFRAGMENTER
+
+// Reads size bytes of the chain starting at first_cluster; returns NULL when the chain is shorter.
+static char *readChain(struct volume_t *volume, uint16_t first_cluster, size_t size) {
+	struct clusters_chain_t *chain = get_chain_fat16(volume->FAT1, volume->bootSector.FatSize * volume->bootSector.BytesPerSector, first_cluster);
+	if (chain == NULL) {
+		return NULL;
+	}
+	char *data = NULL;
+	if (chain->size * volume->geometry.clusterSize >= size) {
+		data = malloc(chain->size * volume->geometry.clusterSize);
+	}
+	for (size_t i = 0; data != NULL && i < chain->size; i++) {
+		if (disk_read(volume->disk, (int32_t) (clusterOffset(volume, chain->clusters[i]) / SECTOR_SIZE), data + i * volume->geometry.clusterSize,
+		              (int32_t) volume->geometry.sectorsPerCluster) == -1) {
+			free(data);
+			data = NULL;
+		}
+	}
+	free(chain->clusters);
+	free(chain);
+	return data;
+}
+
+struct extent_totals_t {
+	size_t entries;
+	size_t fileExtents;
+	size_t fragmented;
+};
+
+static int sumExtents(const struct fragmentation_file_t *entry, void *context) {
+	struct extent_totals_t *totals = context;
+	totals->entries++;
+	if (!entry->is_directory) {
+		totals->fileExtents += entry->extents;
+	}
+	if (entry->extents > 1) {
+		totals->fragmented++;
+	}
+	return 0;
+}
+
+static void checkDotEntries(struct volume_t *volume, const struct walk_list_t *list, const struct walk_item_t *directory) {
+	uint16_t parent = 0;
+	char parentPath[FRAG_MAX_PATH];
+	snprintf(parentPath, sizeof(parentPath), "%s", directory->path);
+	char *separator = strrchr(parentPath, '\\');
+	if (separator != NULL && separator != parentPath) {
+		*separator = '\0';
+		const struct walk_item_t *item = findItem(list, parentPath);
+		parent = item != NULL ? item->firstCluster : 0xFFFF;
+	}
+	struct SFN_t *entries = (struct SFN_t *) readChain(volume, directory->firstCluster, 0);
+	CHECK(entries != NULL && strncmp(entries[0].filename, ".          ", FILE_NAME_LENGTH) == 0 &&
+	      entries[0].firstClusterNumberLowBits == directory->firstCluster, "%s: \".\" does not point at the directory", directory->path);
+	CHECK(entries != NULL && strncmp(entries[1].filename, "..         ", FILE_NAME_LENGTH) == 0 &&
+	      entries[1].firstClusterNumberLowBits == parent, "%s: \"..\" does not point at the parent", directory->path);
+	free(entries);
+}
+
+static void testDefragment(struct volume_t *volume, const char *image, const char *scratch) {
+	char output[PATH_LENGTH];
+	snprintf(output, sizeof(output), "%s/defragmented.img", scratch);
+	static struct walk_list_t before;
+	static struct walk_list_t after;
+
+	CHECK(volume_defragment(volume, image) == -1 && errno == EINVAL, "defragmenting onto the source accepted");
+	CHECK(volume_defragment(volume, output) == 0, "volume_defragment failed: %s", strerror(errno));
+	// fat_open also rejects the image unless both FAT copies are identical.
+	struct volume_t *defragmented = openImage(output);
+	CHECK(defragmented != NULL, "defragmented image does not open");
+	if (defragmented == NULL) {
+		return;
+	}
+
+	walkSorted(volume, "\\", NULL, 1, &before);
+	walkSorted(defragmented, "\\", NULL, 1, &after);
+	CHECK(sameWalk(&before, &after), "defragmented tree differs from the source tree");
+	for (size_t i = 0; i < before.count && i < after.count; i++) {
+		const struct walk_item_t *old = &before.items[i];
+		const struct walk_item_t *new = &after.items[i];
+		if (new->is_directory) {
+			checkDotEntries(defragmented, &after, new);
+			continue;
+		}
+		CHECK(old->size == new->size, "%s: size changed", new->path);
+		if (old->size == 0) {
+			continue;
+		}
+		char *oldData = readChain(volume, old->firstCluster, old->size);
+		char *newData = readChain(defragmented, new->firstCluster, new->size);
+		CHECK(oldData != NULL && newData != NULL && memcmp(oldData, newData, new->size) == 0, "%s: contents changed", new->path);
+		free(oldData);
+		free(newData);
+	}
+
+	const char *rootFiles[] = {"BIG.BIN", "MED.TXT", "SMALL.DAT", "ODD.BIN"};
+	for (size_t i = 0; i < sizeof(rootFiles) / sizeof(rootFiles[0]); i++) {
+		struct file_t *original = file_open(volume, rootFiles[i]);
+		struct file_t *moved = file_open(defragmented, rootFiles[i]);
+		CHECK(original != NULL && moved != NULL, "%s does not open", rootFiles[i]);
+		if (original != NULL && moved != NULL) {
+			size_t size = original->file_info.fileSize;
+			char *a = malloc(size);
+			char *b = malloc(size);
+			CHECK(a != NULL && b != NULL && file_read(a, 1, size, original) == size && file_read(b, 1, size, moved) == size &&
+			      memcmp(a, b, size) == 0, "%s reads back differently through file_read", rootFiles[i]);
+			free(a);
+			free(b);
+		}
+		file_close(original);
+		file_close(moved);
+	}
+
+	struct fragmentation_report_t report;
+	struct extent_totals_t totals = {0};
+	CHECK(fragmentation_report(volume, &report, sumExtents, &totals) == 0 && report.fragmentedFiles > 0 &&
+	      totals.entries == before.count && totals.fileExtents == report.extents,
+	      "source report: %zu fragmented files, %zu callbacks for %zu entries", report.fragmentedFiles, totals.entries, before.count);
+	CHECK(report.files == 11 && report.emptyFiles == 1 && report.directories == 2, "source report counts %zu files, %zu empty, %zu directories",
+	      report.files, report.emptyFiles, report.directories);
+	totals = (struct extent_totals_t) {0};
+	CHECK(fragmentation_report(defragmented, &report, sumExtents, &totals) == 0 && report.fragmentedFiles == 0 &&
+	      report.fragmentedDirectories == 0 && totals.fragmented == 0 && report.extents == report.files - report.emptyFiles,
+	      "defragmented report: %zu fragmented files, %zu fragmented directories", report.fragmentedFiles, report.fragmentedDirectories);
+	closeImage(defragmented);
+}
+
+int main(int argc, char **argv) {
+	if (argc != 3) {
+		fprintf(stderr, "usage: %s <image> <scratch_directory>\n", argv[0]);
+		return 2;
+	}
+	struct volume_t *volume = openImage(argv[1]);
+	if (volume == NULL) {
+		perror(argv[1]);
+		return 2;
+	}
+	testWalker(volume);
+	testDelta(volume, argv[1], argv[2]);
+	testDefragment(volume, argv[1], argv[2]);
+	closeImage(volume);
+
+	printf("%s: %s\n", argv[1], failures == 0 ? "PASS" : "FAIL");
+	return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,137 @@
+#!/usr/bin/env python3
+"""Generates a deterministic FAT16 test image for tests/fat16_selftest.c.
+
+Layout: 512-byte sectors, one reserved sector, two identical FATs and 512 root entries. The tree holds
+root files of several sizes (one spanning a cluster boundary by a few bytes), a zero-length file, a
+deleted entry, a long-file-name entry and a volume label, plus \\SUB with five files and \\SUB\\INNER with
+one more; \\SUB spans two clusters. With --fragment every chain is drawn from a shuffled free list, so files and directories
+are scattered across the data area.
+"""
+import argparse
+import random
+import struct
+
+SECTOR_SIZE = 512
+TOTAL_SECTORS = 60000
+RESERVED_SECTORS = 1
+NUM_FATS = 2
+ROOT_ENTRIES = 512
+ATTR_ARCHIVE = 0x20
+ATTR_READ_ONLY = 0x01
+ATTR_VOLUME_LABEL = 0x08
+ATTR_DIRECTORY = 0x10
+ATTR_LFN = 0x0F
+END_OF_CHAIN = 0xFFFF
+# 2024-01-01 12:00:00, stored the way FAT packs dates and times
+DATE = ((2024 - 1980) << 9) | (1 << 5) | 1
+TIME = 12 << 11
+
+
+def entry(name, attributes, cluster, size, date=DATE):
+    return struct.pack('<11sBBBHHHHHHHI', name, attributes, 0, 0, TIME, date, date, 0, TIME, date, cluster, size)
+
+
+def file_data(name, size):
+    generator = random.Random(name)
+    return bytes(generator.getrandbits(8) for _ in range(size))
+
+
+class Image:
+    def __init__(self, sectors_per_cluster, fragment, seed):
+        self.spc = sectors_per_cluster
+        self.cluster_size = SECTOR_SIZE * sectors_per_cluster
+        self.fat_size = ((TOTAL_SECTORS // sectors_per_cluster + 2) * 2 + SECTOR_SIZE - 1) // SECTOR_SIZE
+        self.root_sector = RESERVED_SECTORS + self.fat_size * NUM_FATS
+        self.data_start = self.root_sector + ROOT_ENTRIES * 32 // SECTOR_SIZE
+        clusters = (TOTAL_SECTORS - self.data_start) // sectors_per_cluster
+        self.image = bytearray(TOTAL_SECTORS * SECTOR_SIZE)
+        self.fat = [0] * (clusters + 2)
+        self.fat[0] = 0xFFF8
+        self.fat[1] = END_OF_CHAIN
+        self.free = list(range(2, clusters + 2))
+        if fragment:
+            random.Random(seed).shuffle(self.free)
+
+    def allocate(self, count):
+        chain = [self.free.pop(0) for _ in range(max(1, count))]
+        for current, following in zip(chain, chain[1:]):
+            self.fat[current] = following
+        self.fat[chain[-1]] = END_OF_CHAIN
+        return chain
+
+    def write_chain(self, chain, data):
+        for index, cluster in enumerate(chain):
+            chunk = data[index * self.cluster_size:(index + 1) * self.cluster_size]
+            offset = (self.data_start + (cluster - 2) * self.spc) * SECTOR_SIZE
+            self.image[offset:offset + len(chunk)] = chunk
+
+    def add_file(self, name, size, attributes=ATTR_ARCHIVE):
+        if size == 0:
+            return entry(name, attributes, 0, 0)
+        chain = self.allocate((size + self.cluster_size - 1) // self.cluster_size)
+        self.write_chain(chain, file_data(name, size))
+        return entry(name, attributes, chain[0], size)
+
+    def add_directory(self, name, parent_cluster, build_entries, entry_clusters=1):
+        chain = self.allocate(entry_clusters)
+        entries = build_entries(chain[0])
+        data = entry(b'.          ', ATTR_DIRECTORY, chain[0], 0) + entry(b'..         ', ATTR_DIRECTORY, parent_cluster, 0) + entries
+        assert len(data) <= len(chain) * self.cluster_size
+        self.write_chain(chain, data)
+        return entry(name, ATTR_DIRECTORY, chain[0], 0)
+
+    def finish(self, root_entries):
+        boot = bytearray(SECTOR_SIZE)
+        boot[0:3] = b'\xeb\x3c\x90'
+        boot[3:11] = b'MKIMAGE '
+        struct.pack_into('<HBHBHHBHHHII', boot, 11, SECTOR_SIZE, self.spc, RESERVED_SECTORS, NUM_FATS, ROOT_ENTRIES,
+                         TOTAL_SECTORS, 0xF8, self.fat_size, 32, 64, 0, 0)
+        boot[38] = 0x29
+        boot[43:54] = b'SELFTEST   '
+        boot[54:62] = b'FAT16   '
+        boot[510:512] = b'\x55\xaa'
+        self.image[0:SECTOR_SIZE] = boot
+        table = b''.join(struct.pack('<H', value) for value in self.fat)
+        for copy in range(NUM_FATS):
+            offset = (RESERVED_SECTORS + self.fat_size * copy) * SECTOR_SIZE
+            self.image[offset:offset + len(table)] = table
+        root = b''.join(root_entries)
+        offset = self.root_sector * SECTOR_SIZE
+        self.image[offset:offset + len(root)] = root
+
+
+def build(sectors_per_cluster, fragment, seed):
+    image = Image(sectors_per_cluster, fragment, seed)
+    root = [entry(b'SELFTEST   ', ATTR_VOLUME_LABEL, 0, 0)]
+    root.append(image.add_file(b'BIG     BIN', 3000000))
+    root.append(image.add_file(b'MED     TXT', 200000))
+    root.append(image.add_file(b'SMALL   DAT', 1000))
+    root.append(image.add_file(b'ODD     BIN', image.cluster_size * 3 + 17))
+    root.append(image.add_file(b'EMPTY   TXT', 0))
+    root.append(b'\xe5' + entry(b'GONE    TXT', ATTR_ARCHIVE, 0, 0)[1:])
+    root.append(b'\x41' + b'l\x00o\x00n\x00g\x00n\x00' + bytes([ATTR_LFN]) + bytes(20))
+
+    def sub_entries(sub_cluster):
+        entries = [image.add_file(('F%d      TXT' % i).encode(), 5000 * (i + 1)) for i in range(5)]
+        entries.append(image.add_directory(b'INNER      ', sub_cluster,
+                                           lambda inner: image.add_file(b'DEEP    TXT', 12345, ATTR_ARCHIVE | ATTR_READ_ONLY)))
+        return b''.join(entries)
+
+    root.append(image.add_directory(b'SUB        ', 0, sub_entries, entry_clusters=2))
+    image.finish(root)
+    return image.image
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__)
+    parser.add_argument('output')
+    parser.add_argument('--sectors-per-cluster', type=int, default=8)
+    parser.add_argument('--fragment', action='store_true')
+    parser.add_argument('--seed', type=int, default=1)
+    arguments = parser.parse_args()
+    with open(arguments.output, 'wb') as output:
+        output.write(build(arguments.sectors_per_cluster, arguments.fragment, arguments.seed))
+
+
+if __name__ == '__main__':
+    main()
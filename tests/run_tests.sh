@@ -0,0 +1,15 @@
+#!/bin/sh
+# Builds tests/fat16_selftest.c and runs it on generated images of every supported cluster size.
+# Extra compiler flags come from CFLAGS, e.g. CFLAGS="-O1 -g -fsanitize=thread" tests/run_tests.sh
+set -e
+cd "$(dirname "$0")/.."
+scratch=$(mktemp -d)
+trap 'rm -rf "$scratch"' EXIT
+
+gcc ${CFLAGS:--O2 -g} -Wall -Wextra -I. tests/fat16_selftest.c file_reader.c -pthread -o "$scratch/fat16_selftest"
+status=0
+for spc in 1 2 4 8 16 32 64; do
+	python3 tests/mkimage.py "$scratch/image$spc.img" --sectors-per-cluster "$spc" --fragment
+	"$scratch/fat16_selftest" "$scratch/image$spc.img" "$scratch" || status=1
+done
+exit $status
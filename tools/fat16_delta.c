@@ -0,0 +1,93 @@
+//
+// Incremental backup tool for FAT16 images built on volume_delta_write/volume_delta_apply.
+//
+// Build from the repository root:
+//   gcc -O2 -I. tools/fat16_delta.c file_reader.c -pthread -o fat16_delta
+// Usage:
+//   fat16_delta write [--full] <older.img> <newer.img> <delta>
+//   fat16_delta apply <base.img> <delta> <output.img>
+//
+
+#include "file_reader.h"
+
+static void printUsage(const char *program) {
+	fprintf(stderr, "usage: %s write [--full] <older.img> <newer.img> <delta>\n", program);
+	fprintf(stderr, "       %s apply <base.img> <delta> <output.img>\n", program);
+}
+
+static struct volume_t *openImage(const char *file_name) {
+	struct disk_t *disk = disk_open_from_file(file_name);
+	if (disk == NULL) {
+		perror(file_name);
+		return NULL;
+	}
+	struct volume_t *volume = fat_open(disk, 0);
+	if (volume == NULL) {
+		perror(file_name);
+		disk_close(disk);
+		return NULL;
+	}
+	return volume;
+}
+
+static void closeImage(struct volume_t *volume) {
+	if (volume == NULL) {
+		return;
+	}
+	struct disk_t *disk = volume->disk;
+	fat_close(volume);
+	disk_close(disk);
+}
+
+static int writeDelta(int argc, char **argv) {
+	int flags = 0;
+	int first = 2;
+	if (argc > first && strcmp(argv[first], "--full") == 0) {
+		flags |= DELTA_FULL_COMPARE;
+		first++;
+	}
+	if (argc - first != 3) {
+		printUsage(argv[0]);
+		return 1;
+	}
+	struct volume_t *older = openImage(argv[first]);
+	struct volume_t *newer = older == NULL ? NULL : openImage(argv[first + 1]);
+	if (newer == NULL) {
+		closeImage(older);
+		return 1;
+	}
+	struct volume_diff_t stats;
+	int result = volume_delta_write(older, newer, argv[first + 2], flags, &stats);
+	if (result == -1) {
+		perror("volume_delta_write");
+	} else {
+		printf("changed entries: %zu\nchanged metadata sectors: %zu\ncompared clusters: %zu\nchanged clusters: %zu\ndelta bytes: %zu\n",
+		       stats.changedEntries, stats.changedMetadataSectors, stats.candidateClusters, stats.changedClusters, stats.deltaBytes);
+	}
+	closeImage(older);
+	closeImage(newer);
+	return result == -1 ? 1 : 0;
+}
+
+static int applyDelta(int argc, char **argv) {
+	if (argc != 5) {
+		printUsage(argv[0]);
+		return 1;
+	}
+	if (volume_delta_apply(argv[2], argv[3], argv[4]) == -1) {
+		perror("volume_delta_apply");
+		return 1;
+	}
+	return 0;
+}
+
+int main(int argc, char **argv) {
+	if (argc >= 2 && strcmp(argv[1], "write") == 0) {
+		return writeDelta(argc, argv);
+	}
+	if (argc >= 2 && strcmp(argv[1], "apply") == 0) {
+		return applyDelta(argc, argv);
+	}
+	printUsage(argv[0]);
+	return 1;
+}